@@ -3,6 +3,7 @@ import os
 import csv
 from sklearn.metrics import f1_score
 from sklearn.neighbors import KNeighborsClassifier
+from emb_io import is_binary, load_binary
 
 
 def read_label(data_dir):
@@ -14,6 +15,8 @@ def read_label(data_dir):
 
 
 def get_emb(vec_file):
+    if is_binary(vec_file):
+        return load_binary(vec_file)[1]
     f = open(vec_file, 'r')
     tmp = f.readlines()
     contents = tmp[1:]
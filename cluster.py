@@ -5,9 +5,12 @@ from sklearn.metrics import mutual_info_score
 from sklearn.metrics import normalized_mutual_info_score
 from sklearn.metrics import adjusted_rand_score
 from sklearn import metrics
+from emb_io import is_binary, load_binary
 
 
 def get_emb(vec_file):
+    if is_binary(vec_file):
+        return load_binary(vec_file)[1]
     f = open(vec_file, 'r')
     tmp = f.readlines()
     contents = tmp[1:]
@@ -116,12 +119,27 @@ if __name__ == "__main__":
     parser.add_argument('--method', choices=['kmeans','skmeans'])
     parser.add_argument('--k', default=20, type=int)
     parser.add_argument('--corpus', default='text.txt')
+    # train on --corpus in this process through jose.py instead of reading --emb_file; options as in eval_cluster.sh
+    parser.add_argument('--train', action='store_true')
+    parser.add_argument('--size', default=100, type=int)
+    parser.add_argument('--window', default=10, type=int)
+    parser.add_argument('--min_count', default=5, type=int)
+    parser.add_argument('--iter', default=20, type=int)
+    parser.add_argument('--threads', default=10, type=int)
 
     args = parser.parse_args()
     print(args)
 
+    if args.train:
+        import jose
+        model = jose.Model(size=args.size, alpha=0.04, margin=0.15, window=args.window, negative=2, sample=1e-3,
+                           min_count=args.min_count, iter=args.iter, threads=args.threads)
+        model.train(os.path.join("./datasets", args.dataset, args.corpus))
+        doc_emb = model.doc_vectors
+
     print(f'### Test: Document Clustering ###')
-    doc_emb = get_emb(vec_file=os.path.join("./datasets", args.dataset, args.emb_file))
+    if not args.train:
+        doc_emb = get_emb(vec_file=os.path.join("./datasets", args.dataset, args.emb_file))
     y_pred = cluster_doc(doc_emb, args.k, args.method)
     y_true = read_label(os.path.join("./datasets", args.dataset))
     res = cal_metric(y_pred, y_true)
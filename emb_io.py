@@ -0,0 +1,26 @@
+import numpy as np
+
+# Layout of the binary embedding format written by `jose -binary 1` (see struct emb_header in src/jose.c)
+EMB_MAGIC = b'JOSEEMB1'
+EMB_HEADER = np.dtype([('magic', 'S8'), ('rows', '<i8'), ('dim', '<i8'), ('names_size', '<i8'),
+                       ('data_offset', '<i8'), ('dtype', '<i4'), ('reserved', '<i4')])
+
+
+def is_binary(vec_file):
+    with open(vec_file, 'rb') as f:
+        return f.read(len(EMB_MAGIC)) == EMB_MAGIC
+
+
+def load_binary(vec_file):
+    """Returns (names, emb): the row names (None for document files) and a read-only, zero-copy
+    numpy.memmap of the rows x dim float32 matrix."""
+    header = np.fromfile(vec_file, dtype=EMB_HEADER, count=1)[0]
+    if header['dtype'] != 0:
+        raise ValueError(f'{vec_file}: unsupported element type {header["dtype"]}')
+    names = None
+    if header['names_size'] > 0:
+        raw = np.fromfile(vec_file, dtype=np.uint8, count=header['names_size'], offset=EMB_HEADER.itemsize)
+        names = raw.tobytes().decode('utf-8', errors='ignore').split('\0')[:-1]
+    emb = np.memmap(vec_file, dtype='<f4', mode='r', offset=int(header['data_offset']),
+                    shape=(int(header['rows']), int(header['dim'])))
+    return names, emb
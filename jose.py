@@ -0,0 +1,164 @@
+import ctypes
+import os
+import numpy as np
+
+# Python binding of the C interface in src/jose.h; build the library first with `make -C src libjose.so`
+LIB_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'src', 'libjose.so')
+
+_lib = None
+
+
+def _load_lib():
+    global _lib
+    if _lib is not None:
+        return _lib
+    lib = ctypes.CDLL(os.environ.get('JOSE_LIB', LIB_FILE))
+    model, ll, s = ctypes.c_void_p, ctypes.c_longlong, ctypes.c_char_p
+    fp = ctypes.POINTER(ctypes.c_float)
+    signatures = {
+        'jose_new': ([], model),
+        'jose_free': ([model], None),
+        'jose_set': ([model, s, s], ctypes.c_int),
+        'jose_last_error': ([], s),
+        'jose_build_vocab': ([model, s], ctypes.c_int),
+        'jose_train': ([model, s], ctypes.c_int),
+        'jose_infer': ([model, s, s], ll),
+        'jose_query': ([model, s, ctypes.c_int, ctypes.c_int, ctypes.POINTER(ll), fp], ctypes.c_int),
+        'jose_save': ([model, s], ctypes.c_int),
+        'jose_load': ([model, s], ctypes.c_int),
+        'jose_vocab_size': ([model], ll),
+        'jose_num_docs': ([model], ll),
+        'jose_dim': ([model], ll),
+        'jose_word': ([model, ll], s),
+        'jose_word_id': ([model, s], ll),
+        'jose_word_vectors': ([model], fp),
+        'jose_context_vectors': ([model], fp),
+        'jose_doc_vectors': ([model], fp),
+        'jose_inferred_vectors': ([model, ctypes.POINTER(ll)], fp),
+    }
+    for name, (argtypes, restype) in signatures.items():
+        getattr(lib, name).argtypes = argtypes
+        getattr(lib, name).restype = restype
+    _lib = lib
+    return lib
+
+
+def _encode(text):
+    return text.encode('utf-8') if text is not None else None
+
+
+def _check(ret, what):
+    if ret < 0:
+        error = _lib.jose_last_error().decode('utf-8', errors='replace')
+        raise RuntimeError(f'jose: {what} failed: {error}')
+    return ret
+
+
+class Model:
+    """A JoSE model trained inside this process. Keyword arguments are command line options of jose
+    without the leading dash and with '_' for '-', e.g. Model(size=100, doc_precision=1).
+
+    The *_vectors properties are zero-copy numpy views of the model's matrices: they stay valid until
+    the model is trained, loaded or closed again, and writing to them changes the model."""
+
+    def __init__(self, **options):
+        self._lib = _load_lib()
+        self._model = self._lib.jose_new()
+        for option, value in options.items():
+            self.set(option, value)
+
+    def close(self):
+        if self._model:
+            self._lib.jose_free(self._model)
+            self._model = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def set(self, option, value):
+        """Sets an option; a list sets a repeatable option such as eval_sim once per value."""
+        option = '-' + option.lstrip('-').replace('_', '-')
+        for value in value if isinstance(value, (list, tuple)) else [value]:
+            if self._lib.jose_set(self._model, _encode(option), _encode(str(value))) != 0:
+                raise ValueError(f'jose: {self._lib.jose_last_error().decode("utf-8", errors="replace")}')
+        return self
+
+    def build_vocab(self, train_file):
+        _check(self._lib.jose_build_vocab(self._model, _encode(train_file)), 'build_vocab')
+        return self
+
+    def train(self, train_file):
+        _check(self._lib.jose_train(self._model, _encode(train_file)), 'train')
+        return self
+
+    def infer(self, text_file, doc_output=None):
+        """Infers document vectors for text_file; returns them as an array unless doc_output is given."""
+        rows = _check(self._lib.jose_infer(self._model, _encode(text_file), _encode(doc_output)), 'infer')
+        if doc_output is not None:
+            return rows
+        rows = ctypes.c_longlong()
+        return self._view(self._lib.jose_inferred_vectors(self._model, ctypes.byref(rows)), rows.value)
+
+    def query(self, query, k=10, type=0):
+        """The k nearest neighbours of a word (type 0: words, 1: documents) or a document id (type 2):
+        a list of (word or document id, cosine similarity), best first."""
+        ids = (ctypes.c_longlong * k)()
+        scores = (ctypes.c_float * k)()
+        n = self._lib.jose_query(self._model, _encode(str(query)), type, k, ids, scores)
+        if n < 0:
+            raise KeyError(query)
+        return [(self.word(ids[i]) if type == 0 else ids[i], scores[i]) for i in range(n)]
+
+    def save(self, prefix):
+        _check(self._lib.jose_save(self._model, _encode(prefix)), 'save')
+        return self
+
+    def load(self, prefix):
+        _check(self._lib.jose_load(self._model, _encode(prefix)), 'load')
+        return self
+
+    @property
+    def vocab_size(self):
+        return self._lib.jose_vocab_size(self._model)
+
+    @property
+    def num_docs(self):
+        return self._lib.jose_num_docs(self._model)
+
+    @property
+    def dim(self):
+        return self._lib.jose_dim(self._model)
+
+    @property
+    def vocab(self):
+        return [self.word(i) for i in range(self.vocab_size)]
+
+    def word(self, i):
+        word = self._lib.jose_word(self._model, i)
+        return word.decode('utf-8', errors='ignore') if word is not None else None
+
+    def word_id(self, word):
+        return self._lib.jose_word_id(self._model, _encode(word))
+
+    @property
+    def word_vectors(self):
+        return self._view(self._lib.jose_word_vectors(self._model), self.vocab_size)
+
+    @property
+    def context_vectors(self):
+        return self._view(self._lib.jose_context_vectors(self._model), self.vocab_size)
+
+    @property
+    def doc_vectors(self):
+        return self._view(self._lib.jose_doc_vectors(self._model), self.num_docs)
+
+    def _view(self, ptr, rows):
+        if not ptr or rows == 0:
+            return None
+        return np.ctypeslib.as_array(ptr, shape=(rows, self.dim))
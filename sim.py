@@ -8,6 +8,7 @@ from gensim.models import word2vec
 from tqdm import tqdm
 from multiprocessing import Pool
 from time import time
+from emb_io import is_binary, load_binary
 
 test_file = {
         "wordsim353" : './datasets/wordsim353/combined.csv',
@@ -16,6 +17,12 @@ test_file = {
     }
 
 def get_emb(vec_file):
+    if is_binary(vec_file):
+        names, emb = load_binary(vec_file)
+        word_emb = {word: emb[i] for i, word in enumerate(names)}
+        vocabulary = {word: i for i, word in enumerate(names)}
+        vocabulary_inv = dict(enumerate(names))
+        return word_emb, vocabulary, vocabulary_inv
     f = open(vec_file, 'r', errors='ignore')
     contents = f.readlines()[1:]
     word_emb = {}
@@ -92,13 +99,28 @@ if __name__ == "__main__":
                                      formatter_class=argparse.ArgumentDefaultsHelpFormatter)
     parser.add_argument('--dataset', default='wiki')
     parser.add_argument('--emb_file', default='jose.txt')
+    # train in this process through jose.py instead of reading --emb_file; options as in eval_sim.sh
+    parser.add_argument('--train', action='store_true')
+    parser.add_argument('--corpus', default='text.txt')
+    parser.add_argument('--size', default=100, type=int)
+    parser.add_argument('--window', default=10, type=int)
+    parser.add_argument('--min_count', default=100, type=int)
+    parser.add_argument('--iter', default=10, type=int)
+    parser.add_argument('--threads', default=20, type=int)
 
     args = parser.parse_args()
     print(args)
 
     test_cases = []
-    print(f"Reading embedding from {os.path.join('datasets', args.dataset, args.emb_file)}")
-    word_emb, vocabulary, vocabulary_inv = get_emb(vec_file=os.path.join('datasets', args.dataset, args.emb_file))
+    if args.train:
+        import jose
+        model = jose.Model(size=args.size, alpha=0.04, margin=0.15, window=args.window, negative=2, sample=1e-3,
+                           min_count=args.min_count, iter=args.iter, threads=args.threads)
+        model.train(os.path.join('datasets', args.dataset, args.corpus))
+        word_emb = dict(zip(model.vocab, model.word_vectors))
+    else:
+        print(f"Reading embedding from {os.path.join('datasets', args.dataset, args.emb_file)}")
+        word_emb, vocabulary, vocabulary_inv = get_emb(vec_file=os.path.join('datasets', args.dataset, args.emb_file))
     
     for key in test_file:
         print(f'### Test: {key} ###')
@@ -0,0 +1,433 @@
+//  Benchmarks for jose: generates a reproducible synthetic corpus with Zipfian word frequencies, times the pieces
+//  of TrainModelThread in isolation (the row kernels of every instruction set the cpu has, negative sampling,
+//  reading text) and the end-to-end training throughput and input share for a growing number of threads (also with
+//  -hot-rows or -prefetch) and of worker processes, and reports every measurement as a CSV row
+//
+//      benchmark,config,value,unit
+//
+//  so that results of different builds and settings can be collected and compared over time.
+
+// jose.c is compiled into this file, so that its kernels can be called directly
+#define main jose_main
+#include "jose.c"
+#undef main
+#include <sys/wait.h>
+
+// the corpus name leaves room for the suffixes of the shards, vocabulary and socket of BenchWorkers
+char bench_output[MAX_STRING], corpus_file[MAX_STRING - 24];
+long long gen_vocab = 30000, gen_docs = 20000, gen_doc_len = 100, gen_seed = 1, bench_hot_rows = 0;
+int max_threads = 0, gen_only = 0, bench_prefetch = 0;
+real zipf = 1.0;
+FILE *fres;
+
+// Writes gen_docs documents (lines) of on average gen_doc_len words drawn from gen_vocab words whose frequency of
+// rank r is proportional to 1 / r^zipf; the same settings and seed always give the same file
+void GenerateCorpus() {
+  long long a, b, len, lo, hi, mid;
+  unsigned long long next_random = gen_seed;
+  double *cdf = (double *) malloc(gen_vocab * sizeof(double)), total = 0, u;
+  FILE *fo = fopen(corpus_file, "wb");
+  if (fo == NULL || cdf == NULL) {
+    printf("ERROR: cannot write corpus %s\n", corpus_file);
+    exit(1);
+  }
+  for (a = 0; a < gen_vocab; a++) cdf[a] = total += pow(a + 1, -zipf);
+  for (a = 0; a < gen_docs; a++) {
+    // document lengths are uniform in [len / 2, 3 * len / 2]
+    next_random = next_random * (unsigned long long) 25214903917 + 11;
+    len = gen_doc_len / 2 + (next_random >> 16) % (gen_doc_len + 1);
+    for (b = 0; b < len; b++) {
+      next_random = next_random * (unsigned long long) 25214903917 + 11;
+      u = (next_random >> 11) / 9007199254740992.0 * total;
+      for (lo = 0, hi = gen_vocab - 1; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+      }
+      fprintf(fo, b ? " w%lld" : "w%lld", lo);
+    }
+    fprintf(fo, "\n");
+  }
+  fclose(fo);
+  free(cdf);
+}
+
+void Report(char *benchmark, char *config, double value, char *unit) {
+  fprintf(fres, "%s,%s,%.6g,%s\n", benchmark, config, value, unit);
+  fflush(fres);
+}
+
+// Unit rows of dimension layer1_size: rows of them in one block, so that rows decides whether they stay in cache
+real *RandomRows(long long rows, unsigned long long *next_random) {
+  long long a, b;
+  real norm, *m = NULL;
+  if (posix_memalign((void **) &m, 128, rows * layer1_size * sizeof(real)) != 0) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < rows; a++) {
+    norm = 0;
+    for (b = 0; b < layer1_size; b++) {
+      *next_random = *next_random * (unsigned long long) 25214903917 + 11;
+      m[a * layer1_size + b] = ((*next_random & 0xFFFF) / (real) 65536) - 0.5;
+      norm += m[a * layer1_size + b] * m[a * layer1_size + b];
+    }
+    ScaleRow(m + a * layer1_size, 1 / sqrt(norm), layer1_size);
+  }
+  return m;
+}
+
+// Times the selected row kernels of the word and document steps on random rows out of a small (cache resident) and
+// a vocabulary sized block
+void BenchKernels() {
+  long long a, i, j, k, calls = 2000000, sizes[2] = {256, gen_vocab};
+  unsigned long long next_random = 1;
+  real f = 0, h = 0, sum = 0, *m, *neu1e = (real *) calloc(layer1_size, sizeof(real));
+  char config[MAX_STRING];
+  double t;
+  for (a = 0; a < 2; a++) {
+    m = RandomRows(sizes[a], &next_random);
+    sprintf(config, "dim=%lld rows=%lld kernels=%s", layer1_size, sizes[a], kernels->name);
+    t = WallTime();
+    for (k = 0; k < calls; k++) {
+      next_random = next_random * (unsigned long long) 25214903917 + 11;
+      i = (next_random >> 16) % sizes[a];
+      j = (next_random >> 40) % sizes[a];
+      Dot2(m + i * layer1_size, m + j * layer1_size, m + ((i + j) % sizes[a]) * layer1_size, layer1_size, &f, &h);
+      sum += f - h;
+    }
+    Report((char *) "kernel_dot2", config, (WallTime() - t) / calls * 1e9, (char *) "ns/call");
+    t = WallTime();
+    for (k = 0; k < calls; k++) {
+      next_random = next_random * (unsigned long long) 25214903917 + 11;
+      i = (next_random >> 16) % sizes[a];
+      j = (next_random >> 40) % sizes[a];
+      MarginUpdate(m + i * layer1_size, m + j * layer1_size, m + ((i + j) % sizes[a]) * layer1_size, neu1e, 0.5, 0.4,
+                   0.001, layer1_size);
+    }
+    Report((char *) "kernel_margin_update", config, (WallTime() - t) / calls * 1e9, (char *) "ns/call");
+    t = WallTime();
+    for (k = 0; k < calls; k++) {
+      next_random = next_random * (unsigned long long) 25214903917 + 11;
+      i = (next_random >> 16) % sizes[a];
+      j = (next_random >> 40) % sizes[a];
+      AnchorUpdate(m + i * layer1_size, m + j * layer1_size, m + ((i + j) % sizes[a]) * layer1_size, 0.5, 0.4, 0.001,
+                   layer1_size);
+    }
+    Report((char *) "kernel_anchor_update", config, (WallTime() - t) / calls * 1e9, (char *) "ns/call");
+    free(m);
+  }
+  // keeps the dot products from being optimised away
+  if (sum == 12345) printf("%f\n", sum);
+  free(neu1e);
+}
+
+// Times building the negative sampling tables and drawing from them, for both samplers
+void BenchSampling() {
+  long long k, draws = 20000000, check = 0;
+  unsigned long long next_random = 1;
+  struct neg_sampler ns;
+  char config[MAX_STRING];
+  double t;
+  sprintf(config, "vocab=%lld", vocab_size);
+  for (sampler = 0; sampler < 2; sampler++) {
+    t = WallTime();
+    InitUnigramTable();
+    Report(sampler ? (char *) "sampler_alias_init" : (char *) "sampler_table_init", config, WallTime() - t,
+           (char *) "s");
+    InitNegSampler(&ns, next_random);
+    t = WallTime();
+    for (k = 0; k < draws; k++) check += DrawNegative(&ns, &next_random);
+    Report(sampler ? (char *) "sampler_alias_draw" : (char *) "sampler_table_draw", config,
+           (WallTime() - t) / draws * 1e9, (char *) "ns/draw");
+  }
+  if (check == 12345) printf("%lld\n", check);
+  free(word_table);
+  free(alias_table);
+  word_table = NULL;
+  alias_table = NULL;
+  sampler = 0;
+}
+
+// Times reading the corpus text and looking up every word, as the training threads do
+void BenchReading() {
+  long long words = 0;
+  char config[MAX_STRING];
+  double t = WallTime();
+  FILE *fin = fopen(corpus_file, "rb");
+  while (1) {
+    ReadWordIndex(fin);
+    if (feof(fin)) break;
+    words++;
+  }
+  fclose(fin);
+  sprintf(config, "vocab=%lld", vocab_size);
+  Report((char *) "read_text", config, words / (WallTime() - t) / 1e6, (char *) "Mwords/s");
+}
+
+// Trains on the corpus with threads threads in a child process, so that every run starts from a clean state, and
+// reports its training throughput, the time spent before training (vocabulary, chunks, initialisation), how
+// long threads waited for the slowest one and the share of their time spent reading (or waiting for -prefetch)
+void BenchTraining(int threads) {
+  long long a;
+  int fds[2];
+  double res[4] = {0, 0, 0, 0}, last, busy = 0;
+  char config[MAX_STRING];
+  pid_t pid;
+  if (pipe(fds) != 0) {
+    printf("ERROR: cannot create pipe\n");
+    exit(1);
+  }
+  fflush(stdout);
+  fflush(fres);
+  pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    if (freopen("/dev/null", "w", stdout) == NULL) exit(1);
+    num_threads = threads;
+    res[1] = WallTime();
+    TrainModel();
+    for (a = 0, last = 0; a < num_threads; a++)
+      if (thread_stats[a].finish_time > last) last = thread_stats[a].finish_time;
+    for (a = 0; a < num_threads; a++) res[2] += last - thread_stats[a].finish_time;
+    res[0] = (word_count_actual - start_word_count) / (last - train_start);
+    res[1] = train_start - res[1];
+    res[2] = last > train_start ? res[2] / (num_threads * (last - train_start)) : 0;
+    for (a = 0; a < num_threads; a++) {
+      res[3] += thread_stats[a].read_time;
+      busy += thread_stats[a].busy_time;
+    }
+    res[3] = busy > 0 ? res[3] / busy : 0;
+    if (write(fds[1], res, sizeof(res)) != sizeof(res)) exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  if (pid < 0 || read(fds[0], res, sizeof(res)) != sizeof(res)) {
+    printf("ERROR: training with %d threads failed\n", threads);
+    exit(1);
+  }
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  sprintf(config, "threads=%d dim=%lld iter=%lld sampler=%d", threads, layer1_size, iter, sampler);
+  if (hot_rows > 0) sprintf(config + strlen(config), " hot_rows=%lld", hot_rows);
+  if (prefetch > 0) sprintf(config + strlen(config), " prefetch=%d", prefetch);
+  Report((char *) "train_throughput", config, res[0], (char *) "words/s");
+  Report((char *) "train_setup", config, res[1], (char *) "s");
+  Report((char *) "train_idle", config, res[2] * 100, (char *) "%");
+  Report((char *) "train_read", config, res[3] * 100, (char *) "%");
+}
+
+// Splits the corpus line by line over the shards and trains them with workers processes of one thread each, which
+// sync their word vectors over a Unix socket as with -workers; reports the aggregate throughput and the scaling
+// efficiency, the share of workers times the throughput of a single worker that it reaches
+void BenchWorkers(int n) {
+  static double single = 0;
+  long long a, len = 0;
+  int r, fds[2];
+  double res[2], words = 0, seconds = 0, last;
+  char config[MAX_STRING], shard[MAX_STRING], *line = NULL;
+  size_t cap = 0;
+  FILE *fin, **fo = (FILE **) malloc(n * sizeof(FILE *));
+  pid_t *pids = (pid_t *) malloc(n * sizeof(pid_t));
+  fin = fopen(corpus_file, "rb");
+  for (r = 0; r < n; r++) {
+    sprintf(shard, "%s.shard%d", corpus_file, r);
+    fo[r] = fopen(shard, "wb");
+    if (fin == NULL || fo[r] == NULL) {
+      printf("ERROR: cannot write %s\n", shard);
+      exit(1);
+    }
+  }
+  for (a = 0; (len = getline(&line, &cap, fin)) > 0; a++) fwrite(line, 1, len, fo[a % n]);
+  fclose(fin);
+  for (r = 0; r < n; r++) fclose(fo[r]);
+  if (pipe(fds) != 0) {
+    printf("ERROR: cannot create pipe\n");
+    exit(1);
+  }
+  fflush(stdout);
+  fflush(fres);
+  for (r = 0; r < n; r++) {
+    pids[r] = fork();
+    if (pids[r] != 0) continue;
+    close(fds[0]);
+    if (freopen("/dev/null", "w", stdout) == NULL) exit(1);
+    num_threads = 1;
+    workers = n;
+    rank = r;
+    sprintf(train_file, "%s.shard%d", corpus_file, r);
+    sprintf(read_vocab_file, "%s.vocab", corpus_file);
+    sprintf(sync_server, "%s.sock", corpus_file);
+    TrainModel();
+    last = thread_stats[0].finish_time;
+    res[0] = word_count_actual - start_word_count;
+    res[1] = last - train_start;
+    if (write(fds[1], res, sizeof(res)) != sizeof(res)) exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  for (r = 0; r < n; r++) {
+    if (pids[r] < 0 || read(fds[0], res, sizeof(res)) != sizeof(res)) {
+      printf("ERROR: training with %d workers failed\n", n);
+      exit(1);
+    }
+    words += res[0];
+    if (res[1] > seconds) seconds = res[1];
+  }
+  close(fds[0]);
+  for (r = 0; r < n; r++) {
+    waitpid(pids[r], NULL, 0);
+    sprintf(shard, "%s.shard%d", corpus_file, r);
+    unlink(shard);
+  }
+  if (n == 1) single = words / seconds;
+  sprintf(config, "workers=%d dim=%lld iter=%lld sampler=%d", n, layer1_size, iter, sampler);
+  Report((char *) "workers_throughput", config, words / seconds, (char *) "words/s");
+  if (single > 0) Report((char *) "workers_efficiency", config, words / seconds / (n * single) * 100, (char *) "%");
+  free(line);
+  free(fo);
+  free(pids);
+}
+
+// Saves the vocabulary of the whole corpus, shared by the workers of BenchWorkers, from a child process
+void SaveCorpusVocab() {
+  pid_t pid;
+  fflush(stdout);
+  fflush(fres);
+  pid = fork();
+  if (pid == 0) {
+    num_threads = max_threads;
+    sprintf(save_vocab_file, "%s.vocab", corpus_file);
+    LearnVocabFromTrainFile();
+    SaveVocab(save_vocab_file);
+    exit(0);
+  }
+  if (pid < 0 || waitpid(pid, NULL, 0) != pid) {
+    printf("ERROR: cannot count the corpus vocabulary\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  int i, threads, remove_corpus = 0;
+  if (argc == 1) {
+    printf("JOSE benchmarks\n\n");
+    printf("Options:\n");
+    printf("\t-output <file>\n");
+    printf("\t\tAppend the results to <file> as CSV rows benchmark,config,value,unit; default is stdout\n");
+    printf("\t-corpus <file>\n");
+    printf("\t\tKeep the generated corpus in <file>; by default it is written to a temporary file and removed\n");
+    printf("\t-gen-only <int>\n");
+    printf("\t\tOnly generate the -corpus file; default is 0\n");
+    printf("\t-vocab <int>\n");
+    printf("\t\tNumber of distinct words of the generated corpus; default is 30000\n");
+    printf("\t-docs <int>\n");
+    printf("\t\tNumber of documents (lines) of the generated corpus; default is 20000\n");
+    printf("\t-doc-len <int>\n");
+    printf("\t\tMean document length in words; default is 100\n");
+    printf("\t-zipf <float>\n");
+    printf("\t\tExponent of the Zipfian word distribution; default is 1.0\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the corpus generator; default is 1\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tMeasure training with 1, 2, 4, ... threads, and as many single-thread workers, up to <int>; default is\n");
+    printf("\t\tthe number of cpus\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tAlso measure training at every thread count with -hot-rows <int>, to compare the scaling with and\n");
+    printf("\t\twithout private copies of the most frequent rows; default is 0 (off)\n");
+    printf("\t-prefetch <int>\n");
+    printf("\t\tAlso measure training at every thread count with -prefetch <int>, to compare the time spent waiting\n");
+    printf("\t\tfor input (train_read) with and without reader threads; default is 0 (off)\n");
+    printf("\t-size, -iter, -window, -negative, -sample, -min-count, -sampler, -batch\n");
+    printf("\t\tTraining settings as for jose; -iter defaults to 1 here\n");
+    printf("\nExamples:\n");
+    printf("./bench -output bench.csv\n");
+    printf("./bench -threads 64 -hot-rows 1000 -output bench.csv\n");
+    printf("./bench -gen-only 1 -corpus zipf.txt -vocab 100000 -docs 1000000 -doc-len 300\n\n");
+    return 0;
+  }
+  iter = 1;
+  debug_mode = 0;
+  max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((i = ArgPos((char *) "-output", argc, argv)) > 0) strcpy(bench_output, argv[i + 1]);
+  if ((i = ArgPos((char *) "-corpus", argc, argv)) > 0) strcpy(corpus_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-gen-only", argc, argv)) > 0) gen_only = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-vocab", argc, argv)) > 0) gen_vocab = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-docs", argc, argv)) > 0) gen_docs = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-doc-len", argc, argv)) > 0) gen_doc_len = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-zipf", argc, argv)) > 0) zipf = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-seed", argc, argv)) > 0) gen_seed = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-threads", argc, argv)) > 0) max_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-hot-rows", argc, argv)) > 0) bench_hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-prefetch", argc, argv)) > 0) bench_prefetch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-sampler", argc, argv)) > 0) sampler = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+  if (gen_vocab <= 0 || gen_docs <= 0 || gen_doc_len <= 0 || max_threads <= 0 || bench_hot_rows < 0 ||
+      bench_prefetch < 0 || bench_prefetch == 1 || (gen_only && corpus_file[0] == 0)) {
+    printf("ERROR: -vocab, -docs, -doc-len and -threads must be positive, -hot-rows must not be negative, -prefetch\n"
+           "must be 0 or at least 2, and -gen-only needs -corpus!\n");
+    exit(1);
+  }
+  if (corpus_file[0] == 0) {
+    strcpy(corpus_file, "/tmp/jose_bench_XXXXXX");
+    i = mkstemp(corpus_file);
+    if (i == -1) {
+      printf("ERROR: cannot create a temporary corpus file\n");
+      exit(1);
+    }
+    close(i);
+    remove_corpus = 1;
+  }
+  fres = bench_output[0] ? fopen(bench_output, "a") : stdout;
+  if (fres == NULL) {
+    printf("ERROR: cannot write %s\n", bench_output);
+    exit(1);
+  }
+  if (fres == stdout || ftell(fres) == 0) fprintf(fres, "benchmark,config,value,unit\n");
+  vocab = (struct vocab_word *) calloc(vocab_max_size, sizeof(struct vocab_word));
+  vocab_hash = BuildVocabHash(NULL, &vocab_hash_size, vocab, 0);
+  SelectKernels();
+  GenerateCorpus();
+  if (gen_only) return 0;
+  strcpy(train_file, corpus_file);
+  // training runs first, each forked from the state before any vocabulary was read
+  for (threads = 1; threads < max_threads; threads *= 2) BenchTraining(threads);
+  BenchTraining(max_threads);
+  if (bench_hot_rows > 0) {
+    hot_rows = bench_hot_rows;
+    for (threads = 1; threads < max_threads; threads *= 2) BenchTraining(threads);
+    BenchTraining(max_threads);
+    hot_rows = 0;
+  }
+  if (bench_prefetch > 0) {
+    prefetch = bench_prefetch;
+    for (threads = 1; threads < max_threads; threads *= 2) BenchTraining(threads);
+    BenchTraining(max_threads);
+    prefetch = 0;
+  }
+  SaveCorpusVocab();
+  for (i = 1; i < max_threads; i *= 2) BenchWorkers(i);
+  BenchWorkers(max_threads);
+  sprintf(save_vocab_file, "%s.vocab", corpus_file);
+  unlink(save_vocab_file);
+  save_vocab_file[0] = 0;
+  num_threads = 1;
+  LearnVocabFromTrainFile();
+  for (i = 0; i < NUM_KERNEL_SETS; i++)
+    if (KernelsSupported(kernel_sets[i])) {
+      kernels = kernel_sets[i];
+      BenchKernels();
+    }
+  SelectKernels();
+  BenchSampling();
+  BenchReading();
+  if (fres != stdout) fclose(fres);
+  if (remove_corpus) unlink(corpus_file);
+  return 0;
+}
@@ -1,21 +1,64 @@
 // The code structure (especially file reading and saving functions) is adapted from the Word2Vec implementation
 //          https://github.com/tmikolov/word2vec
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "jose.h"
+
+int JosePrintf(const char *format, ...);
+void JoseExit(int status) __attribute__((noreturn));
+void CheckThreads();
+#ifdef JOSE_LIBRARY
+// Errors must not end the host process of the library: they are printed and passed to exit as everywhere else,
+// but within a jose_* call JoseExit returns from that call, with the last message printed as jose_last_error. On
+// a thread that the call started, JoseExit ends the thread, and CheckThreads fails the call once it has joined them.
+#define printf(...) JosePrintf(__VA_ARGS__)
+#define exit(status) JoseExit(status)
+#endif
 
 #define MAX_STRING 100
 #define ACOS_TABLE_SIZE 5000
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_CODE_LENGTH 40
+#define CACHE_MAGIC "JOSETOK2"
+#define EMB_MAGIC "JOSEEMB1"
+#define EMB_ALIGN 64
+#define QUERY_BLOCK 1024
+#define QUERY_TILE_ROWS 64
+#define ANN_MAGIC "JOSEANN1"
+#define NEG_LANES 16
+#define NEG_BATCH 256
+#define CKPT_MAGIC "JOSECKP2"
+#define SYNC_BLOCK 4096
+#define SYNC_CONNECT_TRIES 600
+#define PREFETCH_TOKENS 65536
+#define PREFETCH_SENTENCES 2048
+#define PREFETCH_BUFFER (1 << 20)
+#define MAX_EVAL_SIM 8
+#define KMEANS_ITER 20
+#define HOT_STRIPES 64
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
-const int corpus_max_size = 40000000;  // Maximum 40M documents in the corpus
+const long long vocab_reduce_size = 21000000;  // Infrequent words are pruned while the vocabulary exceeds 21M words
 
 typedef float real;
 
@@ -24,27 +67,483 @@ struct vocab_word {
     char *word;
 };
 
+// Open-addressing hash table entry; fp holds the upper hash bits so most probes never touch the word string
+struct vocab_slot {
+    int id;
+    unsigned int fp;
+};
+
+// Word strings are packed into large blocks instead of one allocation per word
+struct string_arena {
+    char **blocks;
+    long long num_blocks, left;
+    char *next;
+};
+
+// Header of the pre-tokenized corpus cache; followed by num_tokens vocab ids (padded to an even count) and
+// corpus_size document end offsets. train_size and train_mtime identify the training file it was built from.
+struct cache_header {
+    char magic[8];
+    long long vocab_size;
+    unsigned long long vocab_checksum;
+    long long num_tokens;
+    long long corpus_size;
+    long long train_size, train_mtime;
+};
+
+// Header of the binary embedding format: the header is followed by names_size bytes of NUL-terminated row names
+// (none for documents), zero padding up to data_offset (a multiple of EMB_ALIGN) and a rows x dim matrix of
+// little-endian float32 values, so that the matrix can be used in place through mmap or numpy.memmap
+struct emb_header {
+    char magic[8];
+    long long rows, dim;
+    long long names_size, data_offset;
+    int dtype;
+    int reserved;
+};
+
+// A binary embedding file mapped into memory
+struct emb_map {
+    void *map;
+    long long map_size;
+    struct emb_header header;
+    char *names;
+    real *data;
+};
+
+// A bucket of the alias sampler: a draw landing in bucket i keeps i below threshold (out of 2^32), else takes alias
+struct alias_slot {
+  unsigned int threshold;
+  int alias;
+};
+
+// Per-thread negative sampler for -sampler 1: NEG_LANES independent xorshift32 generators, stepped together so
+// that the compiler vectorises them, refill a buffer of NEG_BATCH negatives that the training loop consumes
+struct neg_sampler {
+  unsigned int lanes[NEG_LANES];
+  int buf[NEG_BATCH];
+  int pos;
+};
+
+// A top-k result: target row and its cosine similarity to the query
+struct query_hit {
+  long long id;
+  real score;
+};
+
+// Where a training thread stands: its chunk (-1 between chunks), read position in it (file offset or cache token)
+// and document, words read so far and random state. Published at every sentence start for checkpoints.
+struct thread_state {
+  long long chunk, pos, doc, word_count;
+  unsigned long long next_random;
+};
+
+// Sequence count of a training thread's state, odd from the moment it claims a chunk (or starts to publish its state)
+// until the state is published, so that WriteCheckpoint copies the chunk queues and thread states consistently.
+// Padded to a cache line of its own.
+struct state_seq {
+  long long seq;
+  char pad[56];
+};
+
+// Where ReadSentence stands in the chunks of training thread id: the chunk (-1 between chunks) and the pass over the
+// corpus it belongs to, the read position in it (cache token; the file keeps its own), the next document and the
+// document that ends the chunk. next_random is the generator used for subsampling.
+struct sentence_reader {
+  FILE *fi;
+  char *buf;
+  long long id, chunk, pass, pos, next_doc, end_doc;
+  unsigned long long *next_random;
+};
+
+// A sentence read by ReadSentence: its document, its length after subsampling, the words read for it (all of them,
+// for the progress), the pass over the corpus it belongs to and, with checkpoints, where the reader stood before it
+struct sentence_info {
+  long long doc, length, words, pass;
+  struct thread_state state;
+};
+
+// Sentences read ahead for a training thread by its reader thread with -prefetch: a ring of -prefetch blocks of
+// up to PREFETCH_TOKENS words. full counts the blocks filled and not yet handed back by the training thread, which
+// reads the sentences of block tail from sentence next (-1 before it has waited for the block) and word offset on.
+// The reader waits on cond while all blocks are full and the training thread while none is.
+struct prefetch_block {
+  long long *tokens;
+  struct sentence_info *infos;
+  int num, last;
+};
+
+struct prefetch_ring {
+  struct sentence_reader reader;
+  unsigned long long next_random;
+  struct prefetch_block *blocks;
+  int head, tail, full, next;
+  long long offset;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+// The chunks a thread starts out with: all iterations over chunks [first, first + len), handed out in order.
+// Item k of the queue is chunk first + k % len of iteration k / len; next is claimed atomically by the owner
+// and by thieves alike. Padded to a cache line of its own.
+struct chunk_queue {
+  long long next, size, first, len;
+  char pad[32];
+};
+
+// Counters of one training thread. words, the times, pairs, violations and the objectives are published every
+// 10000 words for the progress line and -stats-file; padded to two cache lines of its own.
+struct thread_stats {
+  long long words, chunks, stolen;
+  double finish_time;
+  double read_time, busy_time; // wall time spent reading and parsing the input, and since the thread started
+  long long pairs_w, violations_w, pairs_d, violations_d; // margin comparisons f - h < margin and how many held
+  real obj_w, obj_d; // mean objectives per center word over the last 10000 words
+  char pad[40];
+};
+
+// Word pairs of an -eval-sim dataset whose words are both in the vocabulary (words, two per pair) and their human
+// similarity scores (gold); total counts all pairs of the file
+struct sim_set {
+  long long *words;
+  real *gold;
+  int num, total;
+};
+
+// Margin comparisons of positive and negative samples and how many of them violated the margin
+struct margin_counts {
+  long long pairs, violations;
+};
+
+// A training thread's private copies of the hot_rows most frequent rows of syn0 (rows) and of syn1neg (rows +
+// hot_rows * layer1_size), and the shared rows as of its last merge (base)
+struct hot_cache {
+  real *rows, *base;
+};
+
+// Header of a training checkpoint, followed by the vocabulary counts (vocab_size long longs) and words
+// (names_size bytes, NUL-terminated), num_threads thread states, the num_threads queue positions, the
+// num_chunks + 1 chunk_starts and chunk_docs and, from data_offset on (a multiple of EMB_ALIGN), the syn0, syn1neg
+// and syn1doc matrices
+struct ckpt_header {
+  char magic[8];
+  long long vocab_size, corpus_size, dim, num_threads, cached, iter, num_chunks;
+  long long train_words, word_count_actual, names_size, data_offset, doc_precision;
+  long long train_size, train_mtime; // of the -train file, which resuming needs unchanged
+  real alpha, starting_alpha;
+};
+
+// Message between a worker and the sync server of rank 0, followed by rows row ids (syn0 rows for ids below
+// vocab_size, syn1neg rows id - vocab_size above) and rows x dim floats: from a worker, how its word and context
+// vectors changed since its last sync; from the server, the current values of all rows changed since epoch
+struct sync_header {
+  long long vocab_size, dim, epoch, rows, words;
+  double elapsed, sync_time; // seconds since the worker started training, and spent syncing
+  int rank, done;
+};
+
+// What the sync server knows about a worker, from its latest message
+struct worker_report {
+  long long words, syncs, rows;
+  double elapsed, sync_time;
+};
+
+// Header of the approximate nearest-neighbour index file: the header is followed by the upper-level link offsets
+// (rows long longs), the level of every node (rows ints), the level-0 links (rows x (1 + 2 * m) ints) and the links
+// of the upper levels (upper_size ints). Every link list is a neighbour count followed by that many node ids.
+struct ann_header {
+  char magic[8];
+  long long rows, dim, upper_size, entry;
+  int m, max_level;
+};
+
+// Hierarchical navigable small world graph over the rows of vecs, either built in memory or mapped from a file
+struct ann_index {
+  struct ann_header header;
+  real *vecs;
+  long long *upper_offsets;
+  int *levels, *links0, *links_upper;
+  void *map;
+  long long map_size;
+};
+
+// Per-thread state of a graph search: visit marks (tagged, so they need not be cleared between searches), the
+// candidate heap (best first, scores negated) and the result heap (worst first)
+struct ann_search {
+  unsigned short *visited, tag;
+  struct query_hit *cand, *res;
+  int num_cand, num_res, max_cand, max_res;
+};
+
 char train_file[MAX_STRING], load_emb_file[MAX_STRING];
 char word_emb[MAX_STRING], context_emb[MAX_STRING], doc_output[MAX_STRING];
-char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
+char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING], cache_file[MAX_STRING];
+char query_file[MAX_STRING], query_output[MAX_STRING], load_doc_file[MAX_STRING], ann_file[MAX_STRING];
+char checkpoint_file[MAX_STRING];
 struct vocab_word *vocab;
+struct string_arena vocab_arena;
 int debug_mode = 2, window = 5, min_count = 5, num_threads = 20, min_reduce = 1;
-int *vocab_hash;
-long long *doc_sizes;
+struct vocab_slot *vocab_hash;
+long long vocab_hash_size = 0;
+long long num_chunks = 0, chunks_max = 0, chunk_words = 100000, *chunk_starts, *chunk_docs;
+struct chunk_queue *chunk_queues;
+int numa = 0, num_nodes = 1, *thread_cpus, *thread_nodes, *thread_ranks, *node_threads;
+struct thread_stats *thread_stats;
 long long vocab_max_size = 1000, vocab_size = 0, corpus_size = 0, layer1_size = 100;
-long long train_words = 0, word_count_actual = 0, iter = 10, file_size = 0;
-int negative = 2;
+long long train_words = 0, word_count_actual = 0, start_word_count = 0, iter = 10, file_size = 0;
+// words counted in the vocabulary, for subsampling; more than the train_words of one iteration with -incremental 1
+long long corpus_words = 0;
+int negative = 2, batch = 0, binary = 0, infer = 0, sampler = 0;
 const int table_size = 1e8;
 int *word_table;
+struct alias_slot *alias_table;
 real alpha = 0.04, starting_alpha, sample = 1e-3, margin = 0.15;
 real *syn0, *syn1neg, *syn1doc;
-clock_t start;
+// with -doc-precision 1 (bfloat16) or 2 (float16) the document vectors are kept in syn1doc16 instead of syn1doc
+int doc_precision = 0;
+unsigned short *syn1doc16;
+// with -doc-mmap 1 syn1doc lives in the shared mapping doc_map of the binary -doc-output file
+int doc_mmap = 0;
+char *doc_map;
+long long doc_map_size = 0;
+// with -incremental 1 the -train documents update the old model; doc_ids maps each to the -load-doc row it
+// replaces, or to -1 for a new document appended after the old_doc_rows rows of old_docs
+int incremental = 0;
+char doc_ids_file[MAX_STRING];
+long long *doc_ids, old_doc_rows = 0;
+real *old_docs;
+int *infer_tokens;
+long long *infer_doc_starts, infer_num_docs = 0, infer_block = 100000;
+// inferred vectors kept in memory when there is no -doc-output (jose_infer)
+real *infer_docs;
+long long infer_rows = 0;
+int query_type = 0, top_k = 10;
+real *query_src, *query_dst, *query_vecs;
+long long query_src_rows = 0, query_dst_rows = 0, *query_rows, query_num = 0;
+struct query_hit *query_hits;
+struct ann_index ann;
+int ann_m = 16, ann_ef_construction = 100, ann_ef = 50, *ann_locks;
+long long ann_next = 0;
+pthread_mutex_t ann_lock = PTHREAD_MUTEX_INITIALIZER;
+struct thread_state *thread_states;
+struct state_seq *state_seqs;
+int resume = 0, checkpoint_interval = 1800, stats_interval = 10, training_done = 0;
+char stats_file[MAX_STRING];
+// signalled when the training threads are done, to the checkpoint and stats threads
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+int *cache_tokens;
+long long *cache_doc_ends, cache_num_tokens = 0, cache_map_size = 0;
+void *cache_map;
+double train_start; // wall time at which the training threads were started
+// with -hot-rows K the training threads update the K most frequent rows of syn0 and syn1neg in private copies,
+// which are merged into the shared rows every 10000 words, instead of all writing to the same cache lines. The
+// shared hot rows are split into HOT_STRIPES stripes of consecutive rows with a lock each, so merges of different
+// threads overlap.
+long long hot_rows = 0;
+pthread_mutex_t hot_locks[HOT_STRIPES] = {[0 ... HOT_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER};
+// with -prefetch N every training thread has a reader thread that reads, tokenises and subsamples up to N blocks of
+// sentences ahead, so that the training thread does not wait for the input
+int prefetch = 0;
+// with -eval-sim, -eval-labels or -early-stop the training threads pause when an epoch is complete, while one of them
+// evaluates the model (EvaluateEpoch); eval_next is the word count at which the next evaluation is due (0: none)
+char eval_sim[MAX_EVAL_SIM][MAX_STRING], eval_labels[MAX_STRING];
+int num_eval_sim = 0, eval_k = 0, early_stop = 0, eval_pending = 0, stop_training = 0, eval_bad = 0;
+long long eval_docs = 10000, eval_next = 0, eval_parked = 0, eval_finished = 0, eval_best_epoch = -1;
+real early_stop_delta = 0.001, eval_best = 0;
+pthread_mutex_t eval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t eval_cond = PTHREAD_COND_INITIALIZER;
+struct sim_set *sim_sets;
+// the documents sampled for clustering, their labels (numbered from 0), their unit vectors and cluster assignments
+long long *eval_doc_ids, eval_num_docs = 0;
+int *eval_doc_labels, eval_num_labels = 0, *eval_assign;
+real *eval_vecs, *eval_centroids;
+long long eval_changed = 0;
+// the objectives summed over the center words of every epoch (pass over the chunks), w and d interleaved, and how
+// many center words they were summed over
+double *epoch_obj;
+long long *epoch_steps;
+// with -workers > 1 every worker process trains its own shard and syncs syn0 and syn1neg through the sync server
+// that rank 0 runs on its master copy; sync_base holds both matrices as of the worker's last sync
+int workers = 1, rank = 0, sync_fd = -1, listen_fd = -1, workers_done = 0;
+char sync_server[MAX_STRING];
+real sync_interval = 1;
+real *sync_base, *sync_buf, *master;
+long long *sync_ids, sync_epoch = 0, *master_version, master_epoch = 0;
+// the epoch of the rows the master is receiving from each worker (0 when none), which is not complete yet
+long long *master_applying;
+double sync_time = 0;
+struct worker_report *worker_reports;
+pthread_mutex_t master_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t master_cond = PTHREAD_COND_INITIALIZER;
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// A set of row kernels (kernels.h) for one instruction set; level is its KERNEL_LEVEL
+struct row_kernels {
+  const char *name;
+  int level;
+  void (*dot2)(const real *a, const real *b, const real *c, long long n, real *f, real *h);
+  real (*dot)(const real *a, const real *b, long long n);
+  void (*scale_row)(real *x, real s, long long n);
+  void (*margin_update)(real *pos, real *neg, real *anc, real *neu1e, real f, real h, real lr, long long n);
+  void (*anchor_update)(const real *pos, const real *neg, real *anc, real f, real h, real lr, long long n);
+  void (*mat_vec)(const real *blk, int num_rows, const real *x, real *out, long long n);
+  real (*batch_margin_update)(real **rows, int *owner, int num_rows, real *anc, real *blk, real *sims, real *coef,
+                              real *neu1e, real lr, long long n, struct margin_counts *mc);
+};
+
+// With GCC on x86-64 the kernels are compiled three times, for the baseline of the build flags (SSE with the default
+// make) and with AVX2 and AVX-512 added, and SelectKernels picks the widest the cpu supports at startup. The target
+// pragmas only add instructions, so a build for a wider -march would compile all three sets for it: make native
+// (JOSE_NATIVE), other compilers and other architectures get the one set of the build flags.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(JOSE_NATIVE)
+#define KERNEL_DISPATCH
+#include <immintrin.h>
+#define KERNEL_ISA sse
+#define KERNEL_LEVEL 1
+#include "kernels.h"
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define KERNEL_ISA avx2
+#define KERNEL_LEVEL 2
+#include "kernels.h"
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#define KERNEL_ISA avx512
+#define KERNEL_LEVEL 3
+#include "kernels.h"
+#pragma GCC pop_options
+// widest first
+const struct row_kernels *kernel_sets[] = {&kernels_avx512, &kernels_avx2, &kernels_sse};
+#else
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#define KERNEL_ISA native
+#define KERNEL_LEVEL 0
+#include "kernels.h"
+const struct row_kernels *kernel_sets[] = {&kernels_native};
+#endif
+#define NUM_KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+const struct row_kernels *kernels;
+char kernel_name[MAX_STRING]; // -kernels, the set to use instead of the widest supported one
+
+// Whether the cpu (and the operating system, which must save the wider registers) supports a set of kernels
+int KernelsSupported(const struct row_kernels *k) {
+#ifdef KERNEL_DISPATCH
+  __builtin_cpu_init();
+  if (k->level >= 2 && !(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))) return 0;
+  if (k->level >= 3 && !__builtin_cpu_supports("avx512f")) return 0;
+#endif
+  return 1;
+}
+
+// Picks the -kernels set, or the widest one the cpu supports
+// kernels changes only once the new set is found, as queries of the library may be using it
+void SelectKernels() {
+  long long a;
+  const struct row_kernels *set = NULL;
+  for (a = 0; a < NUM_KERNEL_SETS && set == NULL; a++)
+    if (KernelsSupported(kernel_sets[a]) && (kernel_name[0] == 0 || !strcmp(kernel_name, kernel_sets[a]->name)))
+      set = kernel_sets[a];
+  if (set == NULL) {
+    printf("ERROR: the %s kernels are not supported by this cpu or build!\n", kernel_name);
+    exit(1);
+  }
+  kernels = set;
+}
+
+// The kernels of the selected set, under the names the rest of the code uses
+static inline void Dot2(const real *a, const real *b, const real *c, long long n, real *f, real *h) {
+  kernels->dot2(a, b, c, n, f, h);
+}
 
+static inline real Dot(const real *a, const real *b, long long n) {
+  return kernels->dot(a, b, n);
+}
+
+static inline void ScaleRow(real *x, real s, long long n) {
+  kernels->scale_row(x, s, n);
+}
+
+static inline void MarginUpdate(real *pos, real *neg, real *anc, real *neu1e, real f, real h, real lr, long long n) {
+  kernels->margin_update(pos, neg, anc, neu1e, f, h, lr, n);
+}
+
+static inline void AnchorUpdate(const real *pos, const real *neg, real *anc, real f, real h, real lr, long long n) {
+  kernels->anchor_update(pos, neg, anc, f, h, lr, n);
+}
+
+static inline void MatVec(const real *blk, int num_rows, const real *x, real *out, long long n) {
+  kernels->mat_vec(blk, num_rows, x, out, n);
+}
+
+static inline real BatchMarginUpdate(real **rows, int *owner, int num_rows, real *anc, real *blk, real *sims,
+                                     real *coef, real *neu1e, real lr, long long n, struct margin_counts *mc) {
+  return kernels->batch_margin_update(rows, owner, num_rows, anc, blk, sims, coef, neu1e, lr, n, mc);
+}
+
+// Builds the alias table of the unigram^0.75 distribution with Vose's method in O(V) time and memory. The share
+// of </s> is spread evenly over the real words, which is what the uniform fallback of the table sampler amounts to.
+void InitAliasTable() {
+  long long a, num_small = 0, num_large = 0, s, l;
+  double total = 0, *prob = (double *) malloc(vocab_size * sizeof(double));
+  long long *small = (long long *) malloc(vocab_size * sizeof(long long));
+  long long *large = (long long *) malloc(vocab_size * sizeof(long long));
+  alias_table = (struct alias_slot *) malloc(vocab_size * sizeof(struct alias_slot));
+  if (prob == NULL || small == NULL || large == NULL || alias_table == NULL) {
+    printf("Memory allocation failed (alias table)\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) total += pow(vocab[a].cn, 0.75);
+  for (a = 1; a < vocab_size; a++) prob[a] = (pow(vocab[a].cn, 0.75) + pow(vocab[0].cn, 0.75) / (vocab_size - 1)) /
+                                             total * vocab_size;
+  prob[0] = 0;
+  for (a = 0; a < vocab_size; a++) {
+    if (prob[a] < 1) small[num_small++] = a;
+    else large[num_large++] = a;
+  }
+  while (num_small > 0 && num_large > 0) {
+    s = small[--num_small];
+    l = large[num_large - 1];
+    alias_table[s].threshold = (unsigned int) (prob[s] * 4294967296.0);
+    alias_table[s].alias = l;
+    prob[l] -= 1 - prob[s];
+    if (prob[l] < 1) {
+      num_large--;
+      small[num_small++] = l;
+    }
+  }
+  // whatever is left is full up to rounding
+  while (num_large > 0) {
+    l = large[--num_large];
+    alias_table[l].threshold = 0xFFFFFFFF;
+    alias_table[l].alias = l;
+  }
+  while (num_small > 0) {
+    s = small[--num_small];
+    alias_table[s].threshold = 0xFFFFFFFF;
+    alias_table[s].alias = s;
+  }
+  free(prob);
+  free(small);
+  free(large);
+}
 
 void InitUnigramTable() {
   int a, i;
   double train_words_pow = 0;
   double d1, power = 0.75;
+  if (sampler) {
+    InitAliasTable();
+    return;
+  }
   word_table = (int *) malloc(table_size * sizeof(int));
   for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
   i = 0;
@@ -59,11 +558,59 @@ void InitUnigramTable() {
   }
 }
 
+// Seeds the lanes of a thread's alias sampler from its random state; xorshift32 must not start at 0
+void InitNegSampler(struct neg_sampler *ns, unsigned long long next_random) {
+  int l;
+  for (l = 0; l < NEG_LANES; l++) {
+    next_random = next_random * (unsigned long long) 25214903917 + 11;
+    ns->lanes[l] = (unsigned int) (next_random >> 16);
+    if (ns->lanes[l] == 0) ns->lanes[l] = l + 1;
+  }
+  ns->pos = NEG_BATCH;
+}
+
+// Draws the next NEG_BATCH negatives: the random numbers first, lane by lane, then the alias lookups. A 32-bit
+// draw r picks bucket (r * V) >> 32 and the low 32 bits of r * V decide between the bucket and its alias.
+void FillNegatives(struct neg_sampler *ns) {
+  int i, l;
+  unsigned int x, r[NEG_BATCH];
+  unsigned long long m;
+  for (i = 0; i < NEG_BATCH; i += NEG_LANES)
+    for (l = 0; l < NEG_LANES; l++) {
+      x = ns->lanes[l];
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      ns->lanes[l] = x;
+      r[i + l] = x;
+    }
+  for (i = 0; i < NEG_BATCH; i++) {
+    m = (unsigned long long) r[i] * vocab_size;
+    ns->buf[i] = (unsigned int) m < alias_table[m >> 32].threshold ? (int) (m >> 32) : alias_table[m >> 32].alias;
+  }
+  ns->pos = 0;
+}
+
+// Draws a negative sample from the alias sampler, or else from the unigram table, falling back to a uniform draw
+// over real words for </s>
+static inline long long DrawNegative(struct neg_sampler *ns, unsigned long long *next_random) {
+  long long target;
+  if (alias_table != NULL) {
+    if (ns->pos == NEG_BATCH) FillNegatives(ns);
+    return ns->buf[ns->pos++];
+  }
+  *next_random = *next_random * (unsigned long long) 25214903917 + 11;
+  target = word_table[(*next_random >> 16) % table_size];
+  if (target == 0) target = *next_random % (vocab_size - 1) + 1;
+  return target;
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
   int a = 0, ch;
   while (!feof(fin)) {
     ch = fgetc(fin);
+    if (ch == EOF) break;
     if (ch == 13) continue;
     if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
       if (a > 0) {
@@ -82,32 +629,94 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
+// Returns hash value of a word, computed in a single pass
+static inline unsigned long long GetWordHash(char *word) {
+  unsigned long long hash = 0;
+  for (; *word; word++) hash = hash * 257 + (unsigned char) *word;
+  // final avalanche so that both the slot (low bits) and the fingerprint (high bits) are well mixed
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
   return hash;
 }
 
+// Returns the slot of table holding word, or the empty slot where it would be inserted
+static inline long long FindSlot(struct vocab_slot *table, long long table_size, struct vocab_word *words, char *word,
+                                 unsigned long long hash) {
+  unsigned long long mask = table_size - 1, i = hash & mask;
+  unsigned int fp = hash >> 32;
+  while (table[i].id != -1) {
+    if (table[i].fp == fp && !strcmp(word, words[table[i].id].word)) break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Returns a table of at least twice num_words slots (a power of two) holding the distinct words[0, num_words)
+struct vocab_slot *BuildVocabHash(struct vocab_slot *table, long long *table_size, struct vocab_word *words,
+                                  long long num_words) {
+  long long a, i, size = 1024;
+  unsigned long long hash;
+  while (size < 2 * num_words) size *= 2;
+  if (size != *table_size) {
+    free(table);
+    table = (struct vocab_slot *) malloc(size * sizeof(struct vocab_slot));
+    if (table == NULL) {
+      printf("Memory allocation failed (vocab hash)\n");
+      exit(1);
+    }
+    *table_size = size;
+  }
+  for (a = 0; a < size; a++) table[a].id = -1;
+  for (a = 0; a < num_words; a++) {
+    hash = GetWordHash(words[a].word);
+    i = FindSlot(table, size, words, words[a].word, hash);
+    table[i].id = a;
+    table[i].fp = hash >> 32;
+  }
+  return table;
+}
+
+// Copies word into the arena and returns the stable copy
+char *ArenaStrdup(struct string_arena *arena, char *word) {
+  long long length = strlen(word) + 1, block_size = 1 << 20;
+  char *copy;
+  if (length > MAX_STRING) length = MAX_STRING;
+  if (arena->left < length) {
+    arena->blocks = (char **) realloc(arena->blocks, (arena->num_blocks + 1) * sizeof(char *));
+    arena->next = arena->blocks[arena->num_blocks++] = (char *) malloc(block_size);
+    if (arena->next == NULL) {
+      printf("Memory allocation failed (vocab strings)\n");
+      exit(1);
+    }
+    arena->left = block_size;
+  }
+  copy = arena->next;
+  memcpy(copy, word, length - 1);
+  copy[length - 1] = 0;
+  arena->next += length;
+  arena->left -= length;
+  return copy;
+}
+
+void FreeArena(struct string_arena *arena) {
+  long long a;
+  for (a = 0; a < arena->num_blocks; a++) free(arena->blocks[a]);
+  free(arena->blocks);
+  memset(arena, 0, sizeof(struct string_arena));
+}
+
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
 int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
-  }
-  return -1;
+  return vocab_hash[FindSlot(vocab_hash, vocab_hash_size, vocab, word, GetWordHash(word))].id;
 }
 
-// Locate line number of current file pointer
-int FindLine(FILE *fin) {
-  long long pos = ftell(fin);
+// Locate the document containing position pos, given the sorted end offsets of all documents
+long long FindDoc(long long *doc_ends, long long pos) {
   long long lo = 0, hi = corpus_size - 1;
   while (lo < hi) {
     long long mid = lo + (hi - lo) / 2;
-    if (doc_sizes[mid] > pos) {
+    if (doc_ends[mid] > pos) {
       hi = mid;
     } else {
       lo = mid + 1;
@@ -126,20 +735,23 @@ int ReadWordIndex(FILE *fin) {
 
 // Adds a word to the vocabulary
 int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *) calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
+  unsigned long long hash = GetWordHash(word);
+  long long i;
+  vocab[vocab_size].word = ArenaStrdup(&vocab_arena, word);
   vocab[vocab_size].cn = 0;
   vocab_size++;
   // Reallocate memory if needed
   if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
+    vocab_max_size *= 2;
     vocab = (struct vocab_word *) realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
   }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
+  // Grow the hash table to keep it at most half full
+  if (vocab_size * 2 > vocab_hash_size) vocab_hash = BuildVocabHash(vocab_hash, &vocab_hash_size, vocab, vocab_size);
+  else {
+    i = FindSlot(vocab_hash, vocab_hash_size, vocab, word, hash);
+    vocab_hash[i].id = vocab_size - 1;
+    vocab_hash[i].fp = hash >> 32;
+  }
   return vocab_size - 1;
 }
 
@@ -158,101 +770,287 @@ int IntCompare(const void * a, const void * b)
 
 // Sorts the vocabulary by frequency using word counts
 void SortVocab() {
-  int a, size;
-  unsigned int hash;
+  long long a, size;
   // Sort the vocabulary and keep </s> at the first position
   qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
   size = vocab_size;
   train_words = 0;
   for (a = 0; a < size; a++) {
     // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)) {
-      vocab_size--;
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash = GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
+    if ((vocab[a].cn < min_count) && (a != 0)) vocab_size--;
+    else train_words += vocab[a].cn;
   }
-  vocab = (struct vocab_word *) realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
+  corpus_words = train_words;
+  // Hash will be re-computed, as after the sorting it is not actual
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *) realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  vocab_hash = BuildVocabHash(vocab_hash, &vocab_hash_size, vocab, vocab_size);
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
+  long long a, b = 0;
+  struct string_arena old_arena = vocab_arena;
+  memset(&vocab_arena, 0, sizeof(struct string_arena));
   for (a = 0; a < vocab_size; a++)
     if (vocab[a].cn > min_reduce) {
       vocab[b].cn = vocab[a].cn;
-      vocab[b].word = vocab[a].word;
+      vocab[b].word = ArenaStrdup(&vocab_arena, vocab[a].word);
       b++;
-    } else free(vocab[a].word);
+    }
+  FreeArena(&old_arena);
   vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
-  }
+  // Hash will be re-computed, as it is not actual
+  vocab_hash = BuildVocabHash(vocab_hash, &vocab_hash_size, vocab, vocab_size);
   fflush(stdout);
   min_reduce++;
 }
 
-void LearnVocabFromTrainFile() {
+// Word counts of one line-aligned byte range of the training file, collected by one LearnVocabThread; min_reduce
+// is the pruning threshold of the shard's own ReduceVocab
+struct vocab_shard {
+  long long start, end;
+  struct vocab_word *vocab;
+  long long vocab_size, vocab_max_size, min_reduce;
+  struct vocab_slot *hash;
+  long long hash_size;
+  struct string_arena arena;
+  long long num_docs;
+  long long *chunk_starts, *chunk_docs, num_chunks, chunks_max;
+};
+
+long long vocab_words_read = 0;
+
+// Returns position of a word in the shard vocabulary, adding it with a zero count if it is not there yet
+long long ShardSearchOrAdd(struct vocab_shard *shard, char *word) {
+  unsigned long long hash = GetWordHash(word);
+  long long i = FindSlot(shard->hash, shard->hash_size, shard->vocab, word, hash), a;
+  if (shard->hash[i].id != -1) return shard->hash[i].id;
+  if (shard->vocab_size == shard->vocab_max_size) {
+    shard->vocab_max_size *= 2;
+    shard->vocab = (struct vocab_word *) realloc(shard->vocab, shard->vocab_max_size * sizeof(struct vocab_word));
+  }
+  a = shard->vocab_size++;
+  shard->vocab[a].word = ArenaStrdup(&shard->arena, word);
+  shard->vocab[a].cn = 0;
+  if (shard->vocab_size * 2 > shard->hash_size)
+    shard->hash = BuildVocabHash(shard->hash, &shard->hash_size, shard->vocab, shard->vocab_size);
+  else {
+    shard->hash[i].id = a;
+    shard->hash[i].fp = hash >> 32;
+  }
+  return a;
+}
+
+// ReduceVocab of a shard table: drops the words seen at most min_reduce times, except </s> (id 0), which marks the
+// document ends
+void ShardReduceVocab(struct vocab_shard *shard) {
+  long long a, b = 1;
+  struct string_arena old_arena = shard->arena;
+  memset(&shard->arena, 0, sizeof(struct string_arena));
+  shard->vocab[0].word = ArenaStrdup(&shard->arena, shard->vocab[0].word);
+  for (a = 1; a < shard->vocab_size; a++)
+    if (shard->vocab[a].cn > shard->min_reduce) {
+      shard->vocab[b].cn = shard->vocab[a].cn;
+      shard->vocab[b].word = ArenaStrdup(&shard->arena, shard->vocab[a].word);
+      b++;
+    }
+  FreeArena(&old_arena);
+  shard->vocab_size = b;
+  shard->hash = BuildVocabHash(shard->hash, &shard->hash_size, shard->vocab, shard->vocab_size);
+  shard->min_reduce++;
+}
+
+// Counts the words and documents of one shard into its private table and notes a chunk boundary at the first
+// document end after every chunk_words words. A table that outgrows vocab_reduce_size is pruned like the serial
+// vocabulary, so the counts only equal those of a single pass while no table reaches the limit.
+void *LearnVocabThread(void *arg) {
+  struct vocab_shard *shard = (struct vocab_shard *) arg;
   char word[MAX_STRING];
+  long long i, words = 0, chunk_start_words = 0, read, pos;
+  shard->vocab_max_size = 1024;
+  shard->vocab = (struct vocab_word *) malloc(shard->vocab_max_size * sizeof(struct vocab_word));
+  shard->hash = BuildVocabHash(NULL, &shard->hash_size, shard->vocab, 0);
+  shard->num_docs = 0;
+  shard->vocab_size = 0;
+  shard->min_reduce = 1;
+  ShardSearchOrAdd(shard, (char *) "</s>");
+  FILE *fin = fopen(train_file, "rb");
+  fseek(fin, pos = shard->start, SEEK_SET);
+  while (pos < shard->end) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    if ((++words % 100000 == 0) && (debug_mode > 1)) {
+      read = __sync_add_and_fetch(&vocab_words_read, 100000);
+      printf("%lldK%c", read / 1000, 13);
+      fflush(stdout);
+    }
+    i = ShardSearchOrAdd(shard, word);
+    shard->vocab[i].cn++;
+    if (shard->vocab_size > vocab_reduce_size) ShardReduceVocab(shard);
+    if (i == 0) {
+      shard->num_docs++;
+      // shards end right after a newline, so only a document end can reach the end of the range
+      pos = ftell(fin);
+      if (pos < shard->end && words - chunk_start_words >= chunk_words) {
+        if (shard->num_chunks == shard->chunks_max) {
+          shard->chunks_max = shard->chunks_max * 2 + 16;
+          shard->chunk_starts = (long long *) realloc(shard->chunk_starts, shard->chunks_max * sizeof(long long));
+          shard->chunk_docs = (long long *) realloc(shard->chunk_docs, shard->chunks_max * sizeof(long long));
+        }
+        shard->chunk_starts[shard->num_chunks] = pos;
+        shard->chunk_docs[shard->num_chunks++] = shard->num_docs;
+        chunk_start_words = words;
+      }
+    }
+  }
+  fclose(fin);
+  pthread_exit(NULL);
+}
+
+// Appends a chunk starting at position start (a file offset or cache token) with document doc
+void AddChunk(long long start, long long doc) {
+  // keep room for the end marker
+  if (num_chunks + 1 >= chunks_max) {
+    chunks_max = chunks_max * 2 + 1024;
+    chunk_starts = (long long *) realloc(chunk_starts, chunks_max * sizeof(long long));
+    chunk_docs = (long long *) realloc(chunk_docs, chunks_max * sizeof(long long));
+  }
+  chunk_starts[num_chunks] = start;
+  chunk_docs[num_chunks++] = doc;
+}
+
+// Splits the training file into chunks of whole documents with about chunk_words words each, counting the documents
+void ChunkTrainFile() {
+  const long long buf_max = 1 << 20;
+  char *buf = (char *) malloc(buf_max), *p, *end;
+  long long pos = 0, n, words = 0;
+  int space = 1;
+  FILE *fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  corpus_size = num_chunks = 0;
+  AddChunk(0, 0);
+  while ((n = fread(buf, 1, buf_max, fin)) > 0) {
+    for (p = buf, end = buf + n; p < end; p++) {
+      if (*p == ' ' || *p == '\t' || *p == '\r') space = 1;
+      else if (*p == '\n') {
+        space = 1;
+        corpus_size++;
+        if (words >= chunk_words) {
+          AddChunk(pos + (p - buf) + 1, corpus_size);
+          words = 0;
+        }
+      } else if (space) {
+        space = 0;
+        words++;
+      }
+    }
+    pos += n;
+  }
+  file_size = pos;
+  // a chunk must not start at the end of the file
+  if (chunk_starts[num_chunks - 1] == file_size && num_chunks > 1) num_chunks--;
+  chunk_starts[num_chunks] = file_size;
+  chunk_docs[num_chunks] = corpus_size;
+  fclose(fin);
+  free(buf);
+}
+
+// Splits the corpus cache into chunks of whole documents with about chunk_words tokens each
+void ChunkCorpusCache() {
+  long long d;
+  num_chunks = 0;
+  AddChunk(0, 0);
+  for (d = 0; d + 1 < corpus_size; d++)
+    if (cache_doc_ends[d] - chunk_starts[num_chunks - 1] >= chunk_words) AddChunk(cache_doc_ends[d], d + 1);
+  chunk_starts[num_chunks] = cache_num_tokens;
+  chunk_docs[num_chunks] = corpus_size;
+}
+
+// Splits the corpus again into smaller chunks while some queue would get fewer than two. A queue hands out its chunks
+// once per pass, so with a single chunk its next item is the next pass of the same chunk, which a stealer would train
+// while the owner is still on the last one. -chunk-words itself is left as it was.
+void SplitSmallChunks() {
+  long long keep = chunk_words;
+  if (chunk_words > train_words / (2 * num_threads)) chunk_words = train_words / (2 * num_threads);
+  while (num_chunks < 2 * num_threads && num_chunks < corpus_size && chunk_words > 0) {
+    if (cache_tokens != NULL) ChunkCorpusCache();
+    else ChunkTrainFile();
+    chunk_words /= 2;
+  }
+  chunk_words = keep;
+}
+
+// Counts words with num_threads threads over line-aligned ranges of the training file, then merges the per-thread
+// tables and chunk boundaries in file order. SortVocab orders words by count and then by string, so the result does
+// not depend on the number of threads.
+void LearnVocabFromTrainFile() {
+  char ch;
   FILE *fin;
-  long long a, i;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  long long a, b, i;
+  struct vocab_shard *shards = (struct vocab_shard *) calloc(num_threads, sizeof(struct vocab_shard));
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
   fin = fopen(train_file, "rb");
   if (fin == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
+  fseek(fin, 0, SEEK_END);
+  file_size = ftell(fin);
+  // Move each split point forward to the start of the next line
+  for (a = 0; a < num_threads; a++) {
+    shards[a].end = file_size;
+    if (a == 0) continue;
+    shards[a].start = file_size / num_threads * a;
+    if (shards[a].start < shards[a - 1].start) shards[a].start = shards[a - 1].start;
+    fseek(fin, shards[a].start, SEEK_SET);
+    while (fread(&ch, 1, 1, fin) == 1 && ch != '\n');
+    shards[a].start = ftell(fin);
+    shards[a - 1].end = shards[a].start;
+  }
+  fclose(fin);
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, LearnVocabThread, (void *) &shards[a]);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  CheckThreads();
+
   vocab_size = 0;
   AddWordToVocab((char *) "</s>");
-
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    train_words++;
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("%lldK%c", train_words / 1000, 13);
-      fflush(stdout);
-    }
-    i = SearchVocab(word);
-    if (i == -1) {
-      a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-    } 
-    else if (i == 0) {
-      vocab[i].cn++;
-      doc_sizes[corpus_size] = ftell(fin);
-      corpus_size++;
-      if (corpus_size >= corpus_max_size) {
-        printf("[ERROR] Number of documents in corpus larger than \"corpus_max_size\"! Set a larger \"corpus_max_size\" in Line 18 of jose.c!\n");
-        exit(1);
-      }
+  for (a = 0; a < num_threads; a++) {
+    for (b = 0; b < shards[a].vocab_size; b++) {
+      train_words += shards[a].vocab[b].cn;
+      i = SearchVocab(shards[a].vocab[b].word);
+      if (i == -1) i = AddWordToVocab(shards[a].vocab[b].word);
+      vocab[i].cn += shards[a].vocab[b].cn;
+      if (vocab_size > vocab_reduce_size) ReduceVocab();
     }
-    else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    // every non-empty shard starts a chunk
+    if (shards[a].start < shards[a].end) AddChunk(shards[a].start, corpus_size);
+    for (b = 0; b < shards[a].num_chunks; b++) AddChunk(shards[a].chunk_starts[b], corpus_size + shards[a].chunk_docs[b]);
+    corpus_size += shards[a].num_docs;
+    free(shards[a].vocab);
+    free(shards[a].hash);
+    FreeArena(&shards[a].arena);
+    free(shards[a].chunk_starts);
+    free(shards[a].chunk_docs);
   }
+  if (num_chunks == 0) AddChunk(0, 0);
+  chunk_starts[num_chunks] = file_size;
+  chunk_docs[num_chunks] = corpus_size;
+  free(shards);
+  free(pt);
   SortVocab();
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
 }
 
-void SaveVocab() {
+void SaveVocab(char *file) {
   long long i;
-  FILE *fo = fopen(save_vocab_file, "wb");
+  FILE *fo = fopen(file, "wb");
   for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
   fclose(fo);
 }
@@ -266,7 +1064,6 @@ void ReadVocab() {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
   vocab_size = 0;
   while (1) {
     ReadWord(word, fin);
@@ -280,412 +1077,3869 @@ void ReadVocab() {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  fin = fopen(train_file, "rb");
+}
+
+// Counts and chunks the new documents of the training file like LearnVocabFromTrainFile, then adds the counts of
+// the -read-vocab of the old model. Old words are all kept, new ones need min_count occurrences in the new text.
+// train_words becomes the number of new words (the schedule of one iteration) and corpus_words the merged total.
+void MergeVocab() {
+  long long a, i, n, delta_words = 0, *delta_cn;
+  int keep_min_count = min_count;
+  char c, *old;
+  char word[MAX_STRING];
+  FILE *fin = fopen(read_vocab_file, "rb");
   if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+    printf("Vocabulary file not found\n");
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
+  min_count = 1;
+  LearnVocabFromTrainFile();
+  min_count = keep_min_count;
+  n = vocab_size;
+  delta_cn = (long long *) malloc(n * sizeof(long long));
+  old = (char *) calloc(n, sizeof(char));
+  for (a = 0; a < n; a++) delta_cn[a] = vocab[a].cn;
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    i = SearchVocab(word);
+    if (i == -1) i = AddWordToVocab(word);
+    else if (i < n) old[i] = 1;
+    if (fscanf(fin, "%lld%c", &a, &c) == 2) vocab[i].cn += a;
+  }
   fclose(fin);
+  for (a = 0; a < n; a++) if (old[a] || a == 0 || delta_cn[a] >= min_count) delta_words += delta_cn[a];
+  free(delta_cn);
+  free(old);
+  SortVocab();
+  train_words = delta_words;
+  if (debug_mode > 0) {
+    printf("Merged vocab size: %lld\n", vocab_size);
+    printf("Words in vocab: %lld\n", corpus_words);
+  }
 }
 
-void LoadEmb(char *emb_file, real *emb_ptr) {
-  long long a, b;
-  int *vocab_match_tmp = (int *) calloc(vocab_size, sizeof(int));
-  int vocab_size_tmp = 0, word_dim;
-  char *current_word = (char *) calloc(MAX_STRING, sizeof(char));
-  real *syn_tmp = NULL, norm;
-  unsigned long long next_random = 1;
-  a = posix_memalign((void **) &syn_tmp, 128, (long long) layer1_size * sizeof(real));
-  if (syn_tmp == NULL) {
-    printf("Memory allocation failed\n");
-    exit(1);
+// Checksum of the vocabulary words in id order; a cache is only reused with the vocabulary it was built for
+unsigned long long VocabChecksum() {
+  long long a;
+  unsigned long long hash = 14695981039346656037ULL;
+  char *p;
+  for (a = 0; a < vocab_size; a++) {
+    for (p = vocab[a].word; *p; p++) hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+    hash = (hash ^ 0xFF) * 1099511628211ULL;
   }
-  printf("Loading embedding from file %s\n", emb_file);
-  if (access(emb_file, R_OK) == -1) {
-    printf("File %s does not exist\n", emb_file);
+  return hash;
+}
+
+// Size and modification time (in ns) of the training file, which tell whether a cache or checkpoint was made from
+// the file as it is now; returns 0 if the file cannot be read
+int TrainFileStamp(long long *size, long long *mtime) {
+  struct stat st;
+  if (stat(train_file, &st) != 0) return 0;
+  *size = st.st_size;
+  *mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return 1;
+}
+
+// Tokenizes the training file once into vocab ids (out-of-vocabulary words dropped) and document end offsets
+void WriteCorpusCache() {
+  long long a, num_tokens = 0, num_docs = 0, docs_max = 1000, buf_size = 0;
+  const long long buf_max = 1 << 20;
+  int word;
+  int *buf = (int *) malloc(buf_max * sizeof(int));
+  long long *doc_ends = (long long *) malloc(docs_max * sizeof(long long));
+  struct cache_header header;
+  char tmp_file[MAX_STRING + 8];
+  FILE *fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  // read embedding file
-  FILE *fp = fopen(emb_file, "r");
-  fscanf(fp, "%d", &vocab_size_tmp);
-  fscanf(fp, "%d", &word_dim);
-  if (layer1_size != word_dim) {
-    printf("Embedding dimension incompatible with pretrained file!\n");
+  sprintf(tmp_file, "%s.tmp", cache_file);
+  FILE *fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write corpus cache %s\n", tmp_file);
     exit(1);
   }
-  vocab_size_tmp = 0;
+  if (debug_mode > 0) printf("Writing corpus cache %s\n", cache_file);
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, fo);
   while (1) {
-    fscanf(fp, "%s", current_word);
-    a = SearchVocab(current_word);
-    if (a == -1) {
-      for (b = 0; b < layer1_size; b++) fscanf(fp, "%f", &syn_tmp[b]);
-    }
-    else {
-      for (b = 0; b < layer1_size; b++) fscanf(fp, "%f", &emb_ptr[a * layer1_size + b]);
-      vocab_match_tmp[vocab_size_tmp] = a;
-      vocab_size_tmp++;
+    word = ReadWordIndex(fin);
+    if (feof(fin)) break;
+    if (word == -1) continue;
+    buf[buf_size++] = word;
+    num_tokens++;
+    if (buf_size == buf_max) {
+      fwrite(buf, sizeof(int), buf_size, fo);
+      buf_size = 0;
     }
-    if (feof(fp)) break;
-  }
-  printf("In vocab: %d\n", vocab_size_tmp);
-  qsort(&vocab_match_tmp[0], vocab_size_tmp, sizeof(int), IntCompare);
-  vocab_match_tmp[vocab_size_tmp] = vocab_size;
-  int i = 0;
-  for (a = 0; a < vocab_size; a++) {
-    if (a < vocab_match_tmp[i]) {
-      norm = 0.0;
-      for (b = 0; b < layer1_size; b++) {
-        next_random = next_random * (unsigned long long) 25214903917 + 11;
-        emb_ptr[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
-        norm += emb_ptr[a * layer1_size + b] * emb_ptr[a * layer1_size + b];
+    if (word == 0) {
+      if (num_docs == docs_max) {
+        docs_max *= 2;
+        doc_ends = (long long *) realloc(doc_ends, docs_max * sizeof(long long));
       }
-      for (b = 0; b < layer1_size; b++)
-        emb_ptr[a * layer1_size + b] /= sqrt(norm);
+      doc_ends[num_docs++] = num_tokens;
     }
-    else if (i < vocab_size_tmp) {
-      i++;
+    if ((debug_mode > 1) && (num_tokens % 1000000 == 0)) {
+      printf("%lldM%c", num_tokens / 1000000, 13);
+      fflush(stdout);
     }
   }
-  fclose(fp);
-  free(current_word);
-  free(emb_file);
-  free(vocab_match_tmp);
-  free(syn_tmp);
+  fclose(fin);
+  if (num_tokens % 2) buf[buf_size++] = 0;  // keep the document offsets 8-byte aligned
+  fwrite(buf, sizeof(int), buf_size, fo);
+  fwrite(doc_ends, sizeof(long long), num_docs, fo);
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.vocab_size = vocab_size;
+  header.vocab_checksum = VocabChecksum();
+  header.num_tokens = num_tokens;
+  header.corpus_size = num_docs;
+  TrainFileStamp(&header.train_size, &header.train_mtime);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  a = fclose(fo);
+  if (a != 0 || rename(tmp_file, cache_file) != 0) {
+    printf("ERROR: failed to write corpus cache %s\n", cache_file);
+    exit(1);
+  }
+  free(buf);
+  free(doc_ends);
 }
 
-void InitNet() {
-  long long a, b;
+// Maps the corpus cache into memory, (re)building it first if it is missing, was built for another vocabulary or
+// from another version of the training file (a missing training file leaves the cache as it is)
+void LoadCorpusCache() {
+  struct cache_header header;
+  struct stat st;
+  long long size, mtime;
+  int fd, valid = 0;
+  FILE *fin = fopen(cache_file, "rb");
+  if (fin != NULL) {
+    valid = fread(&header, sizeof(header), 1, fin) == 1 && !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) &&
+            header.vocab_size == vocab_size && header.vocab_checksum == VocabChecksum();
+    fclose(fin);
+    if (!valid) printf("Corpus cache %s does not match the vocabulary; rebuilding\n", cache_file);
+    else if (TrainFileStamp(&size, &mtime) && (size != header.train_size || mtime != header.train_mtime)) {
+      printf("Corpus cache %s was built from another version of %s; rebuilding\n", cache_file, train_file);
+      valid = 0;
+    }
+  }
+  if (!valid) WriteCorpusCache();
+  fd = open(cache_file, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    printf("ERROR: cannot open corpus cache %s\n", cache_file);
+    exit(1);
+  }
+  cache_map_size = st.st_size;
+  cache_map = mmap(NULL, cache_map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cache_map == MAP_FAILED) {
+    printf("ERROR: cannot map corpus cache %s\n", cache_file);
+    exit(1);
+  }
+  memcpy(&header, cache_map, sizeof(header));
+  if (cache_map_size != (long long) sizeof(header) + (header.num_tokens + header.num_tokens % 2) * (long long) sizeof(int) +
+                        header.corpus_size * (long long) sizeof(long long)) {
+    printf("ERROR: corpus cache %s is truncated\n", cache_file);
+    exit(1);
+  }
+  cache_tokens = (int *) ((char *) cache_map + sizeof(header));
+  cache_doc_ends = (long long *) (cache_tokens + header.num_tokens + header.num_tokens % 2);
+  cache_num_tokens = header.num_tokens;
+  corpus_size = header.corpus_size;
+  madvise(cache_map, cache_map_size, MADV_WILLNEED);
+  if (debug_mode > 0) printf("Corpus cache: %lld tokens, %lld documents\n", cache_num_tokens, corpus_size);
+}
+
+// Maps a binary embedding file; returns 0 if the file is not in the binary format
+int MapEmb(char *file, struct emb_map *emb) {
+  struct stat st;
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) return 0;
+  memset(emb, 0, sizeof(struct emb_map));
+  if (read(fd, &emb->header, sizeof(struct emb_header)) != sizeof(struct emb_header) ||
+      memcmp(emb->header.magic, EMB_MAGIC, sizeof(emb->header.magic)) || fstat(fd, &st) == -1) {
+    close(fd);
+    return 0;
+  }
+  if (emb->header.dtype != 0 ||
+      st.st_size < emb->header.data_offset + emb->header.rows * emb->header.dim * (long long) sizeof(real)) {
+    printf("ERROR: binary embedding file %s is truncated or has an unsupported type\n", file);
+    exit(1);
+  }
+  emb->map_size = st.st_size;
+  emb->map = mmap(NULL, emb->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (emb->map == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", file);
+    exit(1);
+  }
+  if (emb->header.names_size > 0) emb->names = (char *) emb->map + sizeof(struct emb_header);
+  emb->data = (real *) ((char *) emb->map + emb->header.data_offset);
+  return 1;
+}
+
+void UnmapEmb(struct emb_map *emb) {
+  munmap(emb->map, emb->map_size);
+}
+
+// Opens an embedding file for rows x layer1_size vectors and writes its header, either as text (a "rows dim" line,
+// then one "name v1 v2 ..." line per row) or, with -binary 1, in the binary format described at struct emb_header.
+// Rows are named after the vocabulary when named is set and by their index otherwise. rows may be -1 when the
+// count is not known yet, in which case FinishEmbFile patches it in.
+FILE *StartEmbFile(char *file, long long rows, int named) {
+  long long a;
+  struct emb_header header;
+  char pad[EMB_ALIGN];
+  FILE *fo = fopen(file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file);
+    exit(1);
+  }
+  if (!binary) {
+    if (rows < 0) fprintf(fo, "%012d %lld\n", 0, layer1_size);
+    else fprintf(fo, "%lld %lld\n", rows, layer1_size);
+    return fo;
+  }
+  memset(&header, 0, sizeof(header));
+  memset(pad, 0, sizeof(pad));
+  memcpy(header.magic, EMB_MAGIC, sizeof(header.magic));
+  header.rows = rows < 0 ? 0 : rows;
+  header.dim = layer1_size;
+  if (named) for (a = 0; a < rows; a++) header.names_size += strlen(vocab[a].word) + 1;
+  header.data_offset = (sizeof(header) + header.names_size + EMB_ALIGN - 1) / EMB_ALIGN * EMB_ALIGN;
+  fwrite(&header, sizeof(header), 1, fo);
+  if (named) for (a = 0; a < rows; a++) fwrite(vocab[a].word, 1, strlen(vocab[a].word) + 1, fo);
+  fwrite(pad, 1, header.data_offset - sizeof(header) - header.names_size, fo);
+  return fo;
+}
+
+// Appends rows vectors, the first of which is row number first of the file
+void WriteEmbRows(FILE *fo, real *emb, long long first, long long rows, int named) {
+  long long a, b;
+  if (binary) {
+    fwrite(emb, sizeof(real), rows * layer1_size, fo);
+    return;
+  }
+  for (a = 0; a < rows; a++) {
+    if (named) fprintf(fo, "%s ", vocab[first + a].word);
+    else fprintf(fo, "%lld ", first + a);
+    for (b = 0; b < layer1_size; b++) {
+      fprintf(fo, "%lf ", emb[a * layer1_size + b]);
+    }
+    fprintf(fo, "\n");
+  }
+}
+
+// Closes an embedding file; for a file started with rows = -1, the final row count is written into its header
+void FinishEmbFile(FILE *fo, char *file, long long rows) {
+  if (rows >= 0) {
+    fseek(fo, binary ? (long) offsetof(struct emb_header, rows) : 0, SEEK_SET);
+    if (binary) fwrite(&rows, sizeof(rows), 1, fo);
+    else fprintf(fo, "%012lld", rows);
+  }
+  if (ferror(fo) || fclose(fo) != 0) {
+    printf("ERROR: failed to write %s\n", file);
+    exit(1);
+  }
+}
+
+void SaveEmb(char *file, real *emb, long long rows, int named) {
+  FILE *fo = StartEmbFile(file, rows, named);
+  WriteEmbRows(fo, emb, 0, rows, named);
+  FinishEmbFile(fo, file, -1);
+}
+
+// Bytes per document vector in the storage format of -doc-precision
+long long DocRowBytes() {
+  return layer1_size * (doc_precision ? sizeof(unsigned short) : sizeof(real));
+}
+
+// bfloat16 is the upper half of a float
+static inline real BF16ToReal(unsigned short h) {
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  v.u = (unsigned int) h << 16;
+  return v.f;
+}
+
+// Rounds to the nearest bfloat16, ties to even
+static inline unsigned short RealToBF16(real x) {
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  v.f = x;
+  return (v.u + 0x7FFF + ((v.u >> 16) & 1)) >> 16;
+}
+
+// float16 is IEEE half precision: 5 exponent and 10 mantissa bits
+static inline real FP16ToReal(unsigned short h) {
+#if defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  unsigned int e = (h >> 10) & 0x1F, m = h & 0x3FF;
+  if (e == 0) return (h & 0x8000 ? -1 : 1) * (real) m * 5.9604644775390625e-8f; // subnormal: m * 2^-24
+  v.u = ((unsigned int) (h & 0x8000) << 16) | (e == 0x1F ? 0x7F800000 | (m << 13) : ((e + 112) << 23) | (m << 13));
+  return v.f;
+#endif
+}
+
+// Rounds to the nearest float16, ties to even
+static inline unsigned short RealToFP16(real x) {
+#if defined(__F16C__)
+  return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  unsigned int sign, a;
+  v.f = x;
+  sign = (v.u >> 16) & 0x8000;
+  a = v.u & 0x7FFFFFFF;
+  if (a >= 0x477FF000) return sign | 0x7C00; // beyond 65504: infinity
+  if (a < 0x38800000) return sign | (unsigned short) lrintf(fabsf(x) * 16777216.0f); // below 2^-14: subnormal
+  a += 0xFFF + ((a >> 13) & 1);
+  return sign | ((a - 0x38000000) >> 13);
+#endif
+}
+
+// Returns document vector doc as floats: the row of syn1doc itself, or with half-precision storage buf holding
+// its conversion when load is set. A converted row is renormalised, so that rounding does not take it off the
+// sphere.
+real *DocRow(long long doc, real *buf, int load) {
+  long long b;
+  real norm = 0;
+  unsigned short *row = syn1doc16 + doc * layer1_size;
+  if (!doc_precision) return syn1doc + doc * layer1_size;
+  if (!load) return buf;
+  if (doc_precision == 1) for (b = 0; b < layer1_size; b++) buf[b] = BF16ToReal(row[b]);
+  else for (b = 0; b < layer1_size; b++) buf[b] = FP16ToReal(row[b]);
+  for (b = 0; b < layer1_size; b++) norm += buf[b] * buf[b];
+  norm = 1 / sqrt(norm);
+  for (b = 0; b < layer1_size; b++) buf[b] *= norm;
+  return buf;
+}
+
+// Stores a row returned by DocRow back into the half-precision document vectors
+void StoreDocRow(long long doc, real *row) {
+  long long b;
+  unsigned short *dst = syn1doc16 + doc * layer1_size;
+  if (doc_precision == 1) for (b = 0; b < layer1_size; b++) dst[b] = RealToBF16(row[b]);
+  else if (doc_precision == 2) for (b = 0; b < layer1_size; b++) dst[b] = RealToFP16(row[b]);
+}
+
+// Stores the row of a training thread back into the half-precision document vector doc, adding what the thread
+// changed since it loaded the vector as base to the vector as it is now and renormalising. Two passes of a chunk can
+// be trained at once by different threads, and overwriting the vector would drop the other thread's updates.
+void MergeDocRow(long long doc, real *row, real *base, real *buf) {
+  long long b;
+  real norm = 0, *cur = DocRow(doc, buf, 1);
+  for (b = 0; b < layer1_size; b++) {
+    cur[b] += row[b] - base[b];
+    norm += cur[b] * cur[b];
+  }
+  ScaleRow(cur, 1 / sqrt(norm), layer1_size);
+  StoreDocRow(doc, cur);
+}
+
+// Appends document vectors 0 .. rows - 1 as rows first, first + 1, ... of an embedding file, converting
+// half-precision ones a block at a time
+void WriteDocRows(FILE *fo, long long first, long long rows) {
+  long long a, b, n, block = 1024;
+  real *buf;
+  if (!doc_precision) {
+    WriteEmbRows(fo, syn1doc, first, rows, 0);
+    return;
+  }
+  buf = (real *) malloc(block * layer1_size * sizeof(real));
+  for (a = 0; a < rows; a += n) {
+    n = rows - a < block ? rows - a : block;
+    for (b = 0; b < n; b++) DocRow(a + b, buf + b * layer1_size, 1);
+    WriteEmbRows(fo, buf, first + a, n, 0);
+  }
+  free(buf);
+}
+
+void LoadEmb(char *emb_file, real *emb_ptr) {
+  long long a, b;
+  int *vocab_match_tmp = (int *) calloc(vocab_size + 1, sizeof(int));
+  int vocab_size_tmp = 0, word_dim;
+  char *current_word = (char *) calloc(MAX_STRING, sizeof(char)), *name;
+  real *syn_tmp = NULL, norm;
   unsigned long long next_random = 1;
-  a = posix_memalign((void **) &syn0, 128, (long long) vocab_size * layer1_size * sizeof(real));
-  if (syn0 == NULL) {
+  struct emb_map emb;
+  FILE *fp = NULL;
+  a = posix_memalign((void **) &syn_tmp, 128, (long long) layer1_size * sizeof(real));
+  if (syn_tmp == NULL) {
     printf("Memory allocation failed\n");
     exit(1);
   }
-
-  a = posix_memalign((void **) &syn1neg, 128, (long long) vocab_size * layer1_size * sizeof(real));
-  a = posix_memalign((void **) &syn1doc, 128, (long long) corpus_size * layer1_size * sizeof(real));
-  if (syn1neg == NULL) {
-    printf("Memory allocation failed (syn1neg)\n");
+  printf("Loading embedding from file %s\n", emb_file);
+  if (access(emb_file, R_OK) == -1) {
+    printf("File %s does not exist\n", emb_file);
+    exit(1);
+  }
+  if (MapEmb(emb_file, &emb)) {
+    // binary embedding file: copy the rows of known words straight out of the mapping
+    if (layer1_size != emb.header.dim) {
+      printf("Embedding dimension incompatible with pretrained file!\n");
+      exit(1);
+    }
+    if (emb.names == NULL) {
+      printf("ERROR: %s has no row names\n", emb_file);
+      exit(1);
+    }
+    for (b = 0, name = emb.names; b < emb.header.rows; b++, name += strlen(name) + 1) {
+      a = SearchVocab(name);
+      if (a == -1) continue;
+      memcpy(emb_ptr + a * layer1_size, emb.data + b * layer1_size, layer1_size * sizeof(real));
+      vocab_match_tmp[vocab_size_tmp] = a;
+      vocab_size_tmp++;
+    }
+    UnmapEmb(&emb);
+  }
+  else fp = fopen(emb_file, "r");
+  if (fp != NULL) {
+    // read text embedding file
+    fscanf(fp, "%d", &vocab_size_tmp);
+    fscanf(fp, "%d", &word_dim);
+    if (layer1_size != word_dim) {
+      printf("Embedding dimension incompatible with pretrained file!\n");
+      exit(1);
+    }
+    vocab_size_tmp = 0;
+    while (1) {
+      if (fscanf(fp, "%s", current_word) != 1) break;
+      a = SearchVocab(current_word);
+      if (a == -1) {
+        for (b = 0; b < layer1_size; b++) fscanf(fp, "%f", &syn_tmp[b]);
+      }
+      else {
+        for (b = 0; b < layer1_size; b++) fscanf(fp, "%f", &emb_ptr[a * layer1_size + b]);
+        vocab_match_tmp[vocab_size_tmp] = a;
+        vocab_size_tmp++;
+      }
+      if (feof(fp)) break;
+    }
+    fclose(fp);
+  }
+  printf("In vocab: %d\n", vocab_size_tmp);
+  qsort(&vocab_match_tmp[0], vocab_size_tmp, sizeof(int), IntCompare);
+  vocab_match_tmp[vocab_size_tmp] = vocab_size;
+  int i = 0;
+  for (a = 0; a < vocab_size; a++) {
+    if (a < vocab_match_tmp[i]) {
+      norm = 0.0;
+      for (b = 0; b < layer1_size; b++) {
+        next_random = next_random * (unsigned long long) 25214903917 + 11;
+        emb_ptr[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+        norm += emb_ptr[a * layer1_size + b] * emb_ptr[a * layer1_size + b];
+      }
+      for (b = 0; b < layer1_size; b++)
+        emb_ptr[a * layer1_size + b] /= sqrt(norm);
+    }
+    else if (i < vocab_size_tmp) {
+      i++;
+    }
+  }
+  free(current_word);
+  free(emb_file);
+  free(vocab_match_tmp);
+  free(syn_tmp);
+}
+
+// Reads the NUMA topology from sysfs and assigns every training thread a cpu: threads are spread over the nodes in
+// contiguous blocks, so that the contiguous runs of chunks they own (and hence their documents) sit on one node
+void InitNumaTopology() {
+  char file[MAX_STRING], list[4096], *p;
+  int a, b, node, first, last, **node_cpus, *num_cpus, used;
+  FILE *fin;
+  node_cpus = (int **) calloc(CPU_SETSIZE, sizeof(int *));
+  num_cpus = (int *) calloc(CPU_SETSIZE, sizeof(int));
+  num_nodes = 0;
+  for (node = 0; node < CPU_SETSIZE; node++) {
+    sprintf(file, "/sys/devices/system/node/node%d/cpulist", node);
+    if ((fin = fopen(file, "r")) == NULL) break;
+    if (fgets(list, sizeof(list), fin) == NULL) list[0] = 0;
+    fclose(fin);
+    // cpulist holds ranges like "0-15,32-47"; nodes without cpus (memory only) are skipped
+    node_cpus[num_nodes] = (int *) malloc(CPU_SETSIZE * sizeof(int));
+    for (p = list; sscanf(p, "%d", &first) == 1;) {
+      last = first;
+      while (*p >= '0' && *p <= '9') p++;
+      if (*p == '-') sscanf(++p, "%d", &last);
+      while (*p >= '0' && *p <= '9') p++;
+      for (a = first; a <= last && num_cpus[num_nodes] < CPU_SETSIZE; a++) node_cpus[num_nodes][num_cpus[num_nodes]++] = a;
+      if (*p != ',') break;
+      p++;
+    }
+    if (num_cpus[num_nodes] > 0) num_nodes++;
+    else free(node_cpus[num_nodes]);
+  }
+  if (num_nodes == 0) {
+    // no NUMA information: one node with all online cpus
+    num_nodes = 1;
+    node_cpus[0] = (int *) malloc(CPU_SETSIZE * sizeof(int));
+    for (a = 0; a < sysconf(_SC_NPROCESSORS_ONLN) && a < CPU_SETSIZE; a++) node_cpus[0][num_cpus[0]++] = a;
+  }
+  thread_cpus = (int *) malloc(num_threads * sizeof(int));
+  thread_nodes = (int *) malloc(num_threads * sizeof(int));
+  thread_ranks = (int *) malloc(num_threads * sizeof(int));
+  node_threads = (int *) calloc(num_nodes, sizeof(int));
+  for (a = 0; a < num_threads; a++) {
+    node = (long long) a * num_nodes / num_threads;
+    used = node_threads[node]++;
+    thread_nodes[a] = node;
+    thread_ranks[a] = used;
+    thread_cpus[a] = node_cpus[node][used % num_cpus[node]];
+  }
+  if (debug_mode > 0) {
+    printf("NUMA: %d node(s);", num_nodes);
+    for (b = 0; b < num_nodes; b++) printf(" node %d runs %d thread(s) on %d cpu(s)", b, node_threads[b], num_cpus[b]);
+    printf("\n");
+  }
+  for (a = 0; a < num_nodes; a++) free(node_cpus[a]);
+  free(node_cpus);
+  free(num_cpus);
+}
+
+// Pins the calling thread to the cpu assigned to training thread id
+void PinThread(long long id) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(thread_cpus[id], &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 && debug_mode > 0)
+    printf("Could not pin thread %lld to cpu %d\n", id, thread_cpus[id]);
+}
+
+// Creates the binary -doc-output file at its final size and maps it shared as syn1doc: training then updates the
+// saved document vectors in place, and the kernel writes back and evicts the rows that are not being trained
+void MapDocFile() {
+  long long data_offset;
+  int fd;
+  FILE *fo = StartEmbFile(doc_output, corpus_size, 0);
+  data_offset = ftell(fo);
+  if (ferror(fo) || fclose(fo) != 0) {
+    printf("ERROR: failed to write %s\n", doc_output);
+    exit(1);
+  }
+  doc_map_size = data_offset + corpus_size * layer1_size * (long long) sizeof(real);
+  fd = open(doc_output, O_RDWR);
+  if (fd == -1 || ftruncate(fd, doc_map_size) != 0) {
+    printf("ERROR: cannot extend %s to %lld bytes\n", doc_output, doc_map_size);
+    exit(1);
+  }
+  doc_map = (char *) mmap(NULL, doc_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (doc_map == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", doc_output);
+    exit(1);
+  }
+  // every thread walks its chunks, and so its documents, in file order
+  madvise(doc_map, doc_map_size, MADV_SEQUENTIAL);
+  syn1doc = (real *) (doc_map + data_offset);
+}
+
+// Flushes the mapped -doc-output file to disk and unmaps it
+void UnmapDocFile() {
+  if (msync(doc_map, doc_map_size, MS_SYNC) != 0 || munmap(doc_map, doc_map_size) != 0) {
+    printf("ERROR: failed to write %s\n", doc_output);
+    exit(1);
+  }
+  syn1doc = NULL;
+}
+
+// Returns untouched, page-aligned memory for rows rows of row_bytes bytes; in NUMA mode its pages are only
+// placed by the first thread that writes them (see NumaPlaceThread)
+void *AllocMatrix(long long rows, long long row_bytes, char *name) {
+  void *mat = NULL;
+  long long bytes = rows * row_bytes;
+  if (numa) {
+    mat = mmap(NULL, bytes > 0 ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mat == MAP_FAILED) mat = NULL;
+  } else if (posix_memalign((void **) &mat, 128, bytes) != 0) mat = NULL;
+  if (mat == NULL) {
+    printf("Memory allocation failed (%s)\n", name);
+    exit(1);
+  }
+  return mat;
+}
+
+void FreeMatrix(void *mat, long long rows, long long row_bytes) {
+  long long bytes = rows * row_bytes;
+  if (mat == NULL) return;
+  if (numa) munmap(mat, bytes > 0 ? bytes : 1);
+  else free(mat);
+}
+
+// Zeroes pages [first, last) of a matrix of bytes bytes
+static void TouchPages(void *mat, long long bytes, long long first, long long last, long long page) {
+  for (; first < last && first * page < bytes; first++)
+    memset((char *) mat + first * page, 0, (first + 1) * page < bytes ? page : bytes - first * page);
+}
+
+// First touch of the matrices from a pinned thread: the pages of syn0 and syn1neg are interleaved over the nodes,
+// and the pages of syn1doc go to the node of the thread that owns the documents in them
+void *NumaPlaceThread(void *id) {
+  long long t = (long long) id, p, pages, page = sysconf(_SC_PAGESIZE), row_bytes = layer1_size * sizeof(real);
+  long long word_bytes = vocab_size * row_bytes, doc_bytes = corpus_size * DocRowBytes(), first, last;
+  void *docs = doc_precision ? (void *) syn1doc16 : (void *) syn1doc;
+  int node = thread_nodes[t], node_rank = thread_ranks[t], count = node_threads[node];
+  PinThread(t);
+  pages = (word_bytes + page - 1) / page;
+  for (p = node + (long long) node_rank * num_nodes; p < pages; p += (long long) count * num_nodes) {
+    TouchPages(syn0, word_bytes, p, p + 1, page);
+    TouchPages(syn1neg, word_bytes, p, p + 1, page);
+  }
+  if (chunk_queues != NULL) {
+    first = chunk_docs[chunk_queues[t].first] * DocRowBytes();
+    last = chunk_docs[chunk_queues[t].first + chunk_queues[t].len] * DocRowBytes();
+    // a page shared by two threads' documents goes to the thread owning its first byte
+    TouchPages(docs, doc_bytes, (first + page - 1) / page, t == num_threads - 1 ? (doc_bytes + page - 1) / page :
+               (last + page - 1) / page, page);
+  } else {
+    pages = (doc_bytes + page - 1) / page;
+    for (p = node + (long long) node_rank * num_nodes; p < pages; p += (long long) count * num_nodes)
+      TouchPages(docs, doc_bytes, p, p + 1, page);
+  }
+  pthread_exit(NULL);
+}
+
+void InitNet() {
+  long long a, b;
+  unsigned long long next_random = 1;
+  pthread_t *pt;
+  real *row = (real *) malloc(layer1_size * sizeof(real));
+  syn0 = (real *) AllocMatrix(vocab_size, layer1_size * sizeof(real), (char *) "syn0");
+  syn1neg = (real *) AllocMatrix(vocab_size, layer1_size * sizeof(real), (char *) "syn1neg");
+  if (doc_mmap) MapDocFile();
+  else if (doc_precision) syn1doc16 = (unsigned short *) AllocMatrix(corpus_size, DocRowBytes(), (char *) "syn1doc");
+  else syn1doc = (real *) AllocMatrix(corpus_size, DocRowBytes(), (char *) "syn1doc");
+  if (numa) {
+    // place the pages before the initialisation below touches them from this thread
+    pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, NumaPlaceThread, (void *) a);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    free(pt);
+  }
+  
+  real norm;
+  if (load_emb_file[0] != 0) {
+    char *center_emb_file = (char *) calloc(MAX_STRING + 8, sizeof(char));
+    char *context_emb_file = (char *) calloc(MAX_STRING + 8, sizeof(char));
+    // binary files take precedence over text ones
+    sprintf(center_emb_file, "%s_w.bin", load_emb_file);
+    if (access(center_emb_file, R_OK) == -1) sprintf(center_emb_file, "%s_w.txt", load_emb_file);
+    sprintf(context_emb_file, "%s_v.bin", load_emb_file);
+    if (access(context_emb_file, R_OK) == -1) sprintf(context_emb_file, "%s_v.txt", load_emb_file);
+    LoadEmb(center_emb_file, syn0);
+    LoadEmb(context_emb_file, syn1neg);
+  }
+  else {
+    for (a = 0; a < vocab_size; a++) {
+      norm = 0.0;
+      for (b = 0; b < layer1_size; b++) {
+        next_random = next_random * (unsigned long long) 25214903917 + 11;
+        syn1neg[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+        norm += syn1neg[a * layer1_size + b] * syn1neg[a * layer1_size + b];
+      }
+      for (b = 0; b < layer1_size; b++)
+        syn1neg[a * layer1_size + b] /= sqrt(norm);
+    }
+    for (a = 0; a < vocab_size; a++) {
+      norm = 0.0;
+      for (b = 0; b < layer1_size; b++) {
+        next_random = next_random * (unsigned long long) 25214903917 + 11;
+        syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+        norm += syn0[a * layer1_size + b] * syn0[a * layer1_size + b];
+      }
+      for (b = 0; b < layer1_size; b++)
+        syn0[a * layer1_size + b] /= sqrt(norm);
+    }
+  }
+
+  for (a = 0; a < corpus_size; a++) {
+    real *doc = DocRow(a, row, 0);
+    norm = 0.0;
+    for (b = 0; b < layer1_size; b++) {
+      next_random = next_random * (unsigned long long) 25214903917 + 11;
+      doc[b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+      norm += doc[b] * doc[b];
+    }
+    for (b = 0; b < layer1_size; b++)
+      doc[b] /= sqrt(norm);
+    // changed documents continue from their old vectors
+    if (incremental && doc_ids[a] >= 0) memcpy(doc, old_docs + doc_ids[a] * layer1_size, layer1_size * sizeof(real));
+    StoreDocRow(a, doc);
+  }
+  free(row);
+}
+
+// Row of word in syn0, or in the private copy of hot (if not NULL) for one of the hot rows
+static inline real *WordRow(struct hot_cache *hot, long long word) {
+  if (hot != NULL && word < hot_rows) return hot->rows + word * layer1_size;
+  return syn0 + word * layer1_size;
+}
+
+// Row of word in syn1neg, or in the private copy of hot (if not NULL) for one of the hot rows
+static inline real *ContextRow(struct hot_cache *hot, long long word) {
+  if (hot != NULL && word < hot_rows) return hot->rows + (hot_rows + word) * layer1_size;
+  return syn1neg + word * layer1_size;
+}
+
+// Shared row i of the hot rows: the syn0 rows first, then the syn1neg rows
+static inline real *HotRow(long long i) {
+  if (i < hot_rows) return syn0 + i * layer1_size;
+  return syn1neg + (i - hot_rows) * layer1_size;
+}
+
+void InitHotCache(struct hot_cache *hot) {
+  long long i, s, bytes = 2 * hot_rows * layer1_size * sizeof(real);
+  if (posix_memalign((void **) &hot->rows, 128, bytes) != 0 || posix_memalign((void **) &hot->base, 128, bytes) != 0) {
+    printf("Memory allocation failed (hot rows)\n");
+    exit(1);
+  }
+  for (s = 0; s < HOT_STRIPES; s++) {
+    pthread_mutex_lock(&hot_locks[s]);
+    for (i = s * 2 * hot_rows / HOT_STRIPES; i < (s + 1) * 2 * hot_rows / HOT_STRIPES; i++)
+      memcpy(hot->rows + i * layer1_size, HotRow(i), layer1_size * sizeof(real));
+    pthread_mutex_unlock(&hot_locks[s]);
+  }
+  memcpy(hot->base, hot->rows, bytes);
+}
+
+// Adds what thread id changed in its hot rows since the last merge to the shared rows, projects those back onto
+// the sphere and refreshes the private copies from them, which brings in the changes of the other threads. Every
+// thread starts at a different stripe, so that threads merging at the same time rarely wait for each other.
+void MergeHotCache(struct hot_cache *hot, long long id) {
+  long long i, b, s, stripe;
+  real *row, *cur, *base, norm;
+  for (s = 0; s < HOT_STRIPES; s++) {
+    stripe = (id * HOT_STRIPES / num_threads + s) % HOT_STRIPES;
+    pthread_mutex_lock(&hot_locks[stripe]);
+    for (i = stripe * 2 * hot_rows / HOT_STRIPES; i < (stripe + 1) * 2 * hot_rows / HOT_STRIPES; i++) {
+      row = HotRow(i);
+      cur = hot->rows + i * layer1_size;
+      base = hot->base + i * layer1_size;
+      if (memcmp(cur, base, layer1_size * sizeof(real))) {
+        norm = 0;
+        for (b = 0; b < layer1_size; b++) {
+          row[b] += cur[b] - base[b];
+          norm += row[b] * row[b];
+        }
+        ScaleRow(row, 1 / sqrt(norm), layer1_size);
+      }
+      memcpy(cur, row, layer1_size * sizeof(real));
+      memcpy(base, row, layer1_size * sizeof(real));
+    }
+    pthread_mutex_unlock(&hot_locks[stripe]);
+  }
+}
+
+// Document step of the training loop: contrasts the positive center word u with negative samples u' against the
+// document vector anc (d), using the hot rows of hot (may be NULL). With frozen set the word vectors are left
+// untouched. Returns the margin objective.
+real DocumentStep(long long word, real *anc, struct hot_cache *hot, struct neg_sampler *ns,
+                  unsigned long long *next_random, real *neu1e, real lr, int frozen, struct margin_counts *mc) {
+  long long d, target;
+  real f, h, obj = 0;
+  real *pos = WordRow(hot, word), *neg; // positive center word u
+  for (d = 1; d < negative + 1; d++) {
+    target = DrawNegative(ns, next_random);
+    if (target == word) continue;
+    neg = WordRow(hot, target); // negative center word u'
+    // f = cos(u, d) = u * d, h = cos(u', d) = u' * d
+    Dot2(pos, neg, anc, layer1_size, &f, &h);
+    mc->pairs++;
+    if (f - h < margin) {
+      mc->violations++;
+      obj += margin - (f - h);
+      // update positive center word, negative center word and document, or the document alone
+      if (frozen) AnchorUpdate(pos, neg, anc, f, h, lr, layer1_size);
+      else MarginUpdate(pos, neg, anc, neu1e, f, h, lr, layer1_size);
+    }
+  }
+  return obj;
+}
+
+// Returns the current time in seconds
+double WallTime() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Splits the iter passes over the num_chunks chunks into one queue per thread, each covering a contiguous run of
+// chunks so that a thread reads the file sequentially until it runs out of work
+void InitChunkQueues() {
+  long long a;
+  chunk_queues = (struct chunk_queue *) calloc(num_threads, sizeof(struct chunk_queue));
+  thread_stats = (struct thread_stats *) calloc(num_threads, sizeof(struct thread_stats));
+  for (a = 0; a < num_threads; a++) {
+    chunk_queues[a].first = num_chunks * a / num_threads;
+    chunk_queues[a].len = num_chunks * (a + 1) / num_threads - chunk_queues[a].first;
+    chunk_queues[a].size = iter * chunk_queues[a].len;
+  }
+}
+
+// Claims the next chunk for thread id and the pass over the corpus it belongs to, from its own queue first and then
+// by stealing from the queues of the other threads; returns 0 once all the work is handed out or training stopped
+int ClaimChunk(long long id, long long *chunk, long long *pass) {
+  long long a, k;
+  struct chunk_queue *queue;
+  if (stop_training) return 0;
+  for (a = 0; a < num_threads; a++) {
+    queue = &chunk_queues[(id + a) % num_threads];
+    if (queue->next >= queue->size) continue;
+    k = __sync_fetch_and_add(&queue->next, 1);
+    if (k >= queue->size) continue;
+    *chunk = queue->first + k % queue->len;
+    *pass = k / queue->len;
+    thread_stats[id].chunks++;
+    if (a > 0) thread_stats[id].stolen++;
+    return 1;
+  }
+  return 0;
+}
+
+// Prints how the work was spread over the training threads
+void ReportLoadBalance() {
+  long long a, max_words = 0, min_words = -1, total_words = 0;
+  double first = -1, last = 0, busy = 0, t, read = 0;
+  printf("\nThread   Words   Chunks  Stolen  Finished (s)\n");
+  for (a = 0; a < num_threads; a++) {
+    t = thread_stats[a].finish_time - train_start;
+    printf("%6lld  %6lldK  %6lld  %6lld  %11.2f\n", a, thread_stats[a].words / 1000, thread_stats[a].chunks,
+           thread_stats[a].stolen, t);
+    total_words += thread_stats[a].words;
+    if (thread_stats[a].words > max_words) max_words = thread_stats[a].words;
+    if (min_words < 0 || thread_stats[a].words < min_words) min_words = thread_stats[a].words;
+    if (first < 0 || t < first) first = t;
+    if (t > last) last = t;
+    busy += t;
+    read += thread_stats[a].read_time;
+  }
+  // idle time: how long threads waited for the slowest one, relative to the whole run
+  printf("Load balance: words per thread %lldK to %lldK (mean %lldK), threads finished between %.2fs and %.2fs "
+         "(%.1f%% idle)\n", min_words / 1000, max_words / 1000, total_words / num_threads / 1000, first, last,
+         last > 0 ? 100 * (1 - busy / (num_threads * last)) : 0.0);
+  printf("Input: threads spent %.1f%% of their time %s\n", busy > 0 ? 100 * read / busy : 0.0,
+         prefetch ? "waiting for their reader threads" : "reading");
+}
+
+// Prints the progress line: rates are words over wall time since training started, the objectives are the
+// means per center word of the last 10000 words of each thread
+void PrintProgress() {
+  long long a, reported = 0;
+  real obj_w = 0, obj_d = 0;
+  double elapsed = WallTime() - train_start;
+  for (a = 0; a < num_threads; a++)
+    if (thread_stats[a].words > 0) {
+      obj_w += thread_stats[a].obj_w;
+      obj_d += thread_stats[a].obj_d;
+      reported++;
+    }
+  if (reported > 0) {
+    obj_w /= reported;
+    obj_d /= reported;
+  }
+  printf("%cAlpha: %f  Objective (w): %f  Objective (d): %f  Progress: %.2f%%  Words/sec: %.2fk  "
+         "Words/thread/sec: %.2fk  ", 13, alpha, obj_w, obj_d, word_count_actual / (real) (iter * train_words + 1) * 100,
+         (word_count_actual - start_word_count) / (elapsed + 1e-9) / 1000,
+         (word_count_actual - start_word_count) / (elapsed + 1e-9) / num_threads / 1000);
+  fflush(stdout);
+}
+
+// Appends one JSON line with the overall and per-thread counters to the -stats-file. Rates and violation shares
+// are over the interval since the previous line, given by prev (num_threads entries, updated here) and prev_time.
+void WriteStats(FILE *fo, struct thread_stats *prev, double *prev_time) {
+  long long a, words = 0, prev_words = 0, pairs, violations;
+  double now = WallTime(), dt = now - *prev_time;
+  struct thread_stats cur;
+  if (dt <= 0) dt = 1e-9;
+  for (a = 0; a < num_threads; a++) {
+    words += thread_stats[a].words;
+    prev_words += prev[a].words;
+  }
+  fprintf(fo, "{\"time\": %.3f, \"progress\": %.6f, \"alpha\": %.6f, \"words\": %lld, \"words_per_sec\": %.1f, "
+          "\"threads\": [", now - train_start, word_count_actual / (double) (iter * train_words + 1), alpha, words,
+          (words - prev_words) / dt);
+  for (a = 0; a < num_threads; a++) {
+    memcpy(&cur, &thread_stats[a], sizeof(cur));
+    fprintf(fo, "%s{\"id\": %lld, \"words\": %lld, \"words_per_sec\": %.1f, \"read_share\": %.4f", a ? ", " : "", a,
+            cur.words, (cur.words - prev[a].words) / dt,
+            cur.busy_time > 0 ? cur.read_time / cur.busy_time : 0.0);
+    pairs = cur.pairs_w - prev[a].pairs_w;
+    violations = cur.violations_w - prev[a].violations_w;
+    fprintf(fo, ", \"violation_rate_w\": %.4f", pairs > 0 ? violations / (double) pairs : 0.0);
+    pairs = cur.pairs_d - prev[a].pairs_d;
+    violations = cur.violations_d - prev[a].violations_d;
+    fprintf(fo, ", \"violation_rate_d\": %.4f", pairs > 0 ? violations / (double) pairs : 0.0);
+    fprintf(fo, ", \"obj_w\": %.6f, \"obj_d\": %.6f, \"chunks\": %lld, \"stolen\": %lld, \"finished\": %s}", cur.obj_w,
+            cur.obj_d, cur.chunks, cur.stolen, cur.finish_time > 0 ? "true" : "false");
+    prev[a] = cur;
+  }
+  fprintf(fo, "]}\n");
+  fflush(fo);
+  *prev_time = now;
+}
+
+// Writes a line of statistics to the -stats-file every stats_interval seconds, and a last one when training ends
+void *StatsThread(void *arg) {
+  struct timespec until;
+  struct thread_stats *prev = (struct thread_stats *) calloc(num_threads, sizeof(struct thread_stats));
+  double prev_time = train_start;
+  FILE *fo = fopen(stats_file, "a");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", stats_file);
+    exit(1);
+  }
+  pthread_mutex_lock(&done_lock);
+  while (!training_done) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += stats_interval;
+    if (pthread_cond_timedwait(&done_cond, &done_lock, &until) != ETIMEDOUT || training_done) continue;
+    pthread_mutex_unlock(&done_lock);
+    WriteStats(fo, prev, &prev_time);
+    pthread_mutex_lock(&done_lock);
+  }
+  pthread_mutex_unlock(&done_lock);
+  WriteStats(fo, prev, &prev_time);
+  fclose(fo);
+  free(prev);
+  pthread_exit(NULL);
+}
+
+// Sends or receives exactly n bytes; returns 0 if the connection was closed or broke
+int SendAll(int fd, void *buf, long long n) {
+  char *p = (char *) buf;
+  ssize_t k;
+  while (n > 0) {
+    k = send(fd, p, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return 0;
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+int RecvAll(int fd, void *buf, long long n) {
+  char *p = (char *) buf;
+  ssize_t k;
+  while (n > 0) {
+    k = recv(fd, p, n, 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return 0;
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+// Opens the -sync-server socket, a Unix socket for a path and TCP for host:port (an empty host listens on all
+// interfaces). Rank 0 listens on it; the other workers connect, retrying for a minute while rank 0 starts up.
+int SyncSocket(int server) {
+  char host[MAX_STRING], *port;
+  struct sockaddr_un un;
+  struct addrinfo hints, *res, *ai;
+  int fd, one = 1, tries;
+  strcpy(host, sync_server);
+  port = strrchr(host, ':');
+  if (port != NULL) *port++ = 0;
+  for (tries = 0; tries < SYNC_CONNECT_TRIES; tries++) {
+    if (port == NULL) {
+      memset(&un, 0, sizeof(un));
+      un.sun_family = AF_UNIX;
+      strncpy(un.sun_path, host, sizeof(un.sun_path) - 1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (server) unlink(host);
+      if (fd >= 0 && (server ? bind(fd, (struct sockaddr *) &un, sizeof(un)) == 0 && listen(fd, workers) == 0
+                             : connect(fd, (struct sockaddr *) &un, sizeof(un)) == 0)) return fd;
+      if (fd >= 0) close(fd);
+    } else {
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = server ? AI_PASSIVE : 0;
+      if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) break;
+      for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (server ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, workers) == 0
+                   : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+          freeaddrinfo(res);
+          return fd;
+        }
+        close(fd);
+      }
+      freeaddrinfo(res);
+    }
+    if (server) break;
+    usleep(100000);
+  }
+  printf("ERROR: cannot %s %s\n", server ? "listen on" : "connect to", sync_server);
+  exit(1);
+}
+
+// Row id of the sync messages: syn0 rows first, then syn1neg rows
+static inline real *SyncRow(long long id) {
+  if (id < vocab_size) return syn0 + id * layer1_size;
+  return syn1neg + (id - vocab_size) * layer1_size;
+}
+
+// Serves one worker: the changes it sends are added to the master vectors, which are renormalised onto the sphere,
+// and the reply holds all rows changed since the worker's last sync. The reply to a final sync waits until every
+// worker has sent its own, so that all workers end with the same vectors.
+void *SyncServeThread(void *arg) {
+  long long a, b, k, n, rows = 2 * vocab_size, epoch, *ids = (long long *) malloc(rows * sizeof(long long));
+  int fd = (int) (long long) arg, finished = 0;
+  real *buf = (real *) malloc(SYNC_BLOCK * layer1_size * sizeof(real)), *m, norm;
+  struct sync_header h;
+  struct worker_report *report;
+  while (RecvAll(fd, &h, sizeof(h))) {
+    if (h.vocab_size != vocab_size || h.dim != layer1_size || h.rank < 0 || h.rank >= workers || h.rows < 0 ||
+        h.rows > rows) {
+      printf("ERROR: worker %d does not have the -read-vocab and -size of rank 0\n", h.rank);
+      exit(1);
+    }
+    if (!RecvAll(fd, ids, h.rows * sizeof(long long))) break;
+    pthread_mutex_lock(&master_lock);
+    epoch = master_applying[h.rank] = ++master_epoch;
+    pthread_mutex_unlock(&master_lock);
+    for (a = 0; a < h.rows; a += k) {
+      k = h.rows - a < SYNC_BLOCK ? h.rows - a : SYNC_BLOCK;
+      if (!RecvAll(fd, buf, k * layer1_size * sizeof(real))) break;
+      pthread_mutex_lock(&master_lock);
+      for (n = 0; n < k; n++) {
+        if (ids[a + n] < 0 || ids[a + n] >= rows) continue;
+        m = master + ids[a + n] * layer1_size;
+        norm = 0;
+        for (b = 0; b < layer1_size; b++) {
+          m[b] += buf[n * layer1_size + b];
+          norm += m[b] * m[b];
+        }
+        ScaleRow(m, 1 / sqrt(norm), layer1_size);
+        master_version[ids[a + n]] = epoch;
+      }
+      pthread_mutex_unlock(&master_lock);
+    }
+    pthread_mutex_lock(&master_lock);
+    master_applying[h.rank] = 0;
+    pthread_mutex_unlock(&master_lock);
+    if (a < h.rows) break;
+    pthread_mutex_lock(&master_lock);
+    report = &worker_reports[h.rank];
+    report->words = h.words;
+    report->elapsed = h.elapsed;
+    report->sync_time = h.sync_time;
+    report->syncs++;
+    report->rows += h.rows;
+    if (h.done) {
+      finished = 1;
+      workers_done++;
+      pthread_cond_broadcast(&master_cond);
+      while (workers_done < workers) pthread_cond_wait(&master_cond, &master_lock);
+    }
+    for (a = n = 0; a < rows; a++) if (master_version[a] > h.epoch) ids[n++] = a;
+    // the worker is up to date with every epoch below the first one still being received from another worker:
+    // rows of that epoch and later go out as they are now, and again once the worker asks past that epoch
+    h.epoch = master_epoch;
+    for (a = 0; a < workers; a++)
+      if (master_applying[a] > 0 && master_applying[a] <= h.epoch) h.epoch = master_applying[a] - 1;
+    h.rows = n;
+    pthread_mutex_unlock(&master_lock);
+    // rows changed by other workers while they are sent simply go out in their newer state
+    if (!SendAll(fd, &h, sizeof(h)) || !SendAll(fd, ids, n * sizeof(long long))) break;
+    for (a = 0; a < n; a += k) {
+      k = n - a < SYNC_BLOCK ? n - a : SYNC_BLOCK;
+      pthread_mutex_lock(&master_lock);
+      for (b = 0; b < k; b++) memcpy(buf + b * layer1_size, master + ids[a + b] * layer1_size, layer1_size * sizeof(real));
+      pthread_mutex_unlock(&master_lock);
+      if (!SendAll(fd, buf, k * layer1_size * sizeof(real))) break;
+    }
+    if (a < n || h.done) break;
+  }
+  if (!finished) {
+    // do not let the others wait for a worker that is gone
+    printf("WARNING: a worker disconnected before finishing\n");
+    pthread_mutex_lock(&master_lock);
+    workers_done++;
+    pthread_cond_broadcast(&master_cond);
+    pthread_mutex_unlock(&master_lock);
+  }
+  close(fd);
+  free(ids);
+  free(buf);
+  pthread_exit(NULL);
+}
+
+// Prints the training rate of every worker, its share of time spent syncing and the aggregate rate
+void ReportWorkers() {
+  long long a, words = 0;
+  double last = 0;
+  struct worker_report *r;
+  printf("\nWorker   Words   Words/sec   Syncs   Rows sent   Sync time (%%)\n");
+  for (a = 0; a < workers; a++) {
+    r = &worker_reports[a];
+    printf("%6lld  %6lldK  %9.2fk  %6lld  %10lld  %14.1f\n", a, r->words / 1000,
+           r->elapsed > 0 ? r->words / r->elapsed / 1000 : 0, r->syncs, r->rows,
+           r->elapsed > 0 ? r->sync_time / r->elapsed * 100 : 0);
+    words += r->words;
+    if (r->elapsed > last) last = r->elapsed;
+  }
+  printf("Aggregate: %.2fk words/sec over %d workers\n", last > 0 ? words / last / 1000 : 0, workers);
+}
+
+// Accepts the connections of all workers, rank 0 included, and serves each in a thread of its own
+void *SyncServerThread(void *arg) {
+  long long a;
+  int fd, one = 1;
+  pthread_t *pt = (pthread_t *) malloc(workers * sizeof(pthread_t));
+  for (a = 0; a < workers; a++) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        a--;
+        continue;
+      }
+      printf("ERROR: cannot accept workers on %s\n", sync_server);
+      exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_create(&pt[a], NULL, SyncServeThread, (void *) (long long) fd);
+  }
+  for (a = 0; a < workers; a++) pthread_join(pt[a], NULL);
+  close(listen_fd);
+  if (strchr(sync_server, ':') == NULL) unlink(sync_server);
+  free(pt);
+  pthread_exit(NULL);
+}
+
+// Sends the changes of the word and context vectors since the last sync, as differences to sync_base, and applies
+// the rows the server returns: a row keeps the updates made since it was sent on top of the master values
+void SyncVectors(int done) {
+  long long a, b, i, k, n = 0, rows = 2 * vocab_size;
+  real *cur, *base, *delta, *m, c;
+  double start = WallTime();
+  struct sync_header h;
+  int ok;
+  for (a = 0; a < rows; a++)
+    if (memcmp(SyncRow(a), sync_base + a * layer1_size, layer1_size * sizeof(real))) sync_ids[n++] = a;
+  memset(&h, 0, sizeof(h));
+  h.vocab_size = vocab_size;
+  h.dim = layer1_size;
+  h.epoch = sync_epoch;
+  h.rows = n;
+  h.words = word_count_actual - start_word_count;
+  h.elapsed = start - train_start;
+  h.sync_time = sync_time;
+  h.rank = rank;
+  h.done = done;
+  ok = SendAll(sync_fd, &h, sizeof(h)) && SendAll(sync_fd, sync_ids, n * sizeof(long long));
+  for (a = 0; ok && a < n; a += k) {
+    k = n - a < SYNC_BLOCK ? n - a : SYNC_BLOCK;
+    for (i = 0; i < k; i++) {
+      cur = SyncRow(sync_ids[a + i]);
+      base = sync_base + sync_ids[a + i] * layer1_size;
+      delta = sync_buf + i * layer1_size;
+      for (b = 0; b < layer1_size; b++) {
+        c = cur[b];
+        delta[b] = c - base[b];
+        base[b] = c;
+      }
+    }
+    ok = SendAll(sync_fd, sync_buf, k * layer1_size * sizeof(real));
+  }
+  ok = ok && RecvAll(sync_fd, &h, sizeof(h)) && h.rows >= 0 && h.rows <= rows &&
+       RecvAll(sync_fd, sync_ids, h.rows * sizeof(long long));
+  for (a = 0; ok && a < h.rows; a += k) {
+    k = h.rows - a < SYNC_BLOCK ? h.rows - a : SYNC_BLOCK;
+    if (!(ok = RecvAll(sync_fd, sync_buf, k * layer1_size * sizeof(real)))) break;
+    for (i = 0; i < k; i++) {
+      cur = SyncRow(sync_ids[a + i]);
+      base = sync_base + sync_ids[a + i] * layer1_size;
+      m = sync_buf + i * layer1_size;
+      // untouched values are set exactly, so that they do not count as changed at the next sync
+      for (b = 0; b < layer1_size; b++) {
+        c = cur[b];
+        cur[b] = c == base[b] ? m[b] : c + (m[b] - base[b]);
+        base[b] = m[b];
+      }
+    }
+  }
+  if (!ok) {
+    printf("ERROR: lost the connection to the sync server %s\n", sync_server);
+    exit(1);
+  }
+  sync_epoch = h.epoch;
+  sync_time += WallTime() - start;
+}
+
+// Syncs every -sync-interval seconds while training runs, and once more, waiting for all workers, at the end
+void *SyncThread(void *arg) {
+  struct timespec until;
+  sync_fd = SyncSocket(0);
+  pthread_mutex_lock(&done_lock);
+  while (!training_done) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (time_t) sync_interval;
+    until.tv_nsec += (long) ((sync_interval - (time_t) sync_interval) * 1e9);
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait(&done_cond, &done_lock, &until) != ETIMEDOUT || training_done) continue;
+    pthread_mutex_unlock(&done_lock);
+    SyncVectors(0);
+    pthread_mutex_lock(&done_lock);
+  }
+  pthread_mutex_unlock(&done_lock);
+  SyncVectors(1);
+  close(sync_fd);
+  pthread_exit(NULL);
+}
+
+// Takes the initial word and context vectors, the same in every worker, as the common starting point; rank 0 also
+// keeps them as the master copy and starts serving
+void StartSync(pthread_t *server_thread) {
+  long long a, rows = 2 * vocab_size;
+  sync_base = (real *) malloc(rows * layer1_size * sizeof(real));
+  sync_buf = (real *) malloc(SYNC_BLOCK * layer1_size * sizeof(real));
+  sync_ids = (long long *) malloc(rows * sizeof(long long));
+  if (sync_base == NULL || sync_buf == NULL || sync_ids == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < rows; a++) memcpy(sync_base + a * layer1_size, SyncRow(a), layer1_size * sizeof(real));
+  if (rank != 0) return;
+  master = (real *) malloc(rows * layer1_size * sizeof(real));
+  master_version = (long long *) calloc(rows, sizeof(long long));
+  master_applying = (long long *) calloc(workers, sizeof(long long));
+  worker_reports = (struct worker_report *) calloc(workers, sizeof(struct worker_report));
+  if (master == NULL || master_version == NULL || master_applying == NULL || worker_reports == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(master, sync_base, rows * layer1_size * sizeof(real));
+  listen_fd = SyncSocket(1);
+  pthread_create(server_thread, NULL, SyncServerThread, NULL);
+}
+
+// Counts the vocabulary words and document ends of the training file, the words of one iteration, for a worker
+// whose -read-vocab counts the whole corpus rather than its shard
+void CountTrainWords() {
+  int word;
+  FILE *fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  train_words = 0;
+  while (1) {
+    word = ReadWordIndex(fin);
+    if (feof(fin)) break;
+    if (word != -1) train_words++;
+  }
+  fclose(fin);
+  if (debug_mode > 0) printf("Words in shard: %lld\n", train_words);
+}
+
+static inline void OpenStateSection(long long id) {
+  if (!(state_seqs[id].seq & 1)) __sync_fetch_and_add(&state_seqs[id].seq, 1);
+}
+
+static inline void CloseStateSection(long long id) {
+  __sync_fetch_and_add(&state_seqs[id].seq, 1);
+}
+
+// Opens the input for the chunks of training thread id, continuing with -resume from the position in its
+// checkpointed state. A reader thread (-prefetch) reads through a large buffer and tells the kernel to read ahead.
+void OpenSentenceReader(struct sentence_reader *r, long long id, unsigned long long *next_random) {
+  struct thread_state *state = thread_states != NULL ? &thread_states[id] : NULL;
+  memset(r, 0, sizeof(struct sentence_reader));
+  r->id = id;
+  r->chunk = -1;
+  r->next_random = next_random;
+  if (cache_tokens == NULL) {
+    r->fi = fopen(train_file, "rb");
+    if (prefetch) {
+      r->buf = (char *) malloc(PREFETCH_BUFFER);
+      setvbuf(r->fi, r->buf, _IOFBF, PREFETCH_BUFFER);
+      posix_fadvise(fileno(r->fi), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+  }
+  if (resume && state->chunk >= 0) {
+    r->chunk = state->chunk;
+    // the checkpoint does not keep the pass, so it is taken from the progress
+    r->pass = word_count_actual / (train_words + 1);
+    r->next_doc = state->doc;
+    if (cache_tokens != NULL) r->pos = state->pos;
+    else fseek(r->fi, state->pos, SEEK_SET);
+    r->end_doc = r->chunk + 1 < num_chunks ? chunk_docs[r->chunk + 1] : -1;
+  }
+}
+
+void CloseSentenceReader(struct sentence_reader *r) {
+  if (r->fi != NULL) fclose(r->fi);
+  free(r->buf);
+}
+
+// Reads the next sentence of the reader's chunks into sen: the subsampled words of a document, or of its next
+// MAX_SENTENCE_LENGTH words. Returns 0 when there are no chunks left.
+int ReadSentence(struct sentence_reader *r, long long *sen, struct sentence_info *info) {
+  long long word;
+  if (r->chunk < 0) {
+    // move on to the next chunk of documents; the state section ends when the training thread publishes its state
+    if (thread_states != NULL) OpenStateSection(r->id);
+    if (!ClaimChunk(r->id, &r->chunk, &r->pass)) return 0;
+    if (cache_tokens != NULL) r->pos = chunk_starts[r->chunk];
+    else {
+      fseek(r->fi, chunk_starts[r->chunk], SEEK_SET);
+      if (prefetch) posix_fadvise(fileno(r->fi), chunk_starts[r->chunk],
+                                  chunk_starts[r->chunk + 1] - chunk_starts[r->chunk], POSIX_FADV_WILLNEED);
+    }
+    r->next_doc = chunk_docs[r->chunk];
+    // the last chunk runs to the end of the input
+    r->end_doc = r->chunk + 1 < num_chunks ? chunk_docs[r->chunk + 1] : -1;
+  }
+  // a last line without a newline belongs to the last document
+  info->doc = r->next_doc < corpus_size ? r->next_doc : corpus_size - 1;
+  info->length = info->words = 0;
+  info->pass = r->pass;
+  if (thread_states != NULL) {
+    info->state.chunk = r->chunk;
+    info->state.pos = cache_tokens != NULL ? r->pos : ftell(r->fi);
+    info->state.doc = r->next_doc;
+    info->state.next_random = *r->next_random;
+  }
+  while (1) {
+    if (cache_tokens != NULL) {
+      if (r->pos >= cache_num_tokens) {
+        r->chunk = -1;
+        break;
+      }
+      word = cache_tokens[r->pos++];
+    } else {
+      word = ReadWordIndex(r->fi);
+      if (feof(r->fi)) {
+        r->chunk = -1;
+        break;
+      }
+      if (word == -1) continue;
+    }
+    info->words++;
+    if (word == 0) {
+      if (++r->next_doc == r->end_doc) r->chunk = -1;
+      break;
+    }
+    if (sample > 0) {
+      real ran = (sqrt(vocab[word].cn / (sample * corpus_words)) + 1) * (sample * corpus_words) / vocab[word].cn;
+      *r->next_random = *r->next_random * (unsigned long long) 25214903917 + 11;
+      if (ran < (*r->next_random & 0xFFFF) / (real) 65536) continue;
+    }
+    sen[info->length] = word;
+    info->length++;
+    if (info->length >= MAX_SENTENCE_LENGTH) break;
+  }
+  return 1;
+}
+
+// Reader thread of -prefetch: fills the blocks of a ring with sentences as long as some are free
+void *PrefetchThread(void *arg) {
+  struct prefetch_ring *ring = (struct prefetch_ring *) arg;
+  struct prefetch_block *blk;
+  long long len;
+  int more = 1;
+  while (more) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->full == prefetch) pthread_cond_wait(&ring->cond, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+    blk = &ring->blocks[ring->head];
+    blk->num = 0;
+    for (len = 0; blk->num < PREFETCH_SENTENCES && len + MAX_SENTENCE_LENGTH <= PREFETCH_TOKENS;
+         len += blk->infos[blk->num++].length)
+      if (!(more = ReadSentence(&ring->reader, blk->tokens + len, &blk->infos[blk->num]))) break;
+    blk->last = !more;
+    ring->head = (ring->head + 1) % prefetch;
+    pthread_mutex_lock(&ring->lock);
+    ring->full++;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  pthread_exit(NULL);
+}
+
+// Starts the reader thread of training thread id, reading from where the thread stands and subsampling with a
+// generator seeded like the thread's
+void StartPrefetch(struct prefetch_ring *ring, long long id, unsigned long long next_random) {
+  int a;
+  ring->next_random = next_random;
+  OpenSentenceReader(&ring->reader, id, &ring->next_random);
+  ring->blocks = (struct prefetch_block *) calloc(prefetch, sizeof(struct prefetch_block));
+  for (a = 0; a < prefetch; a++) {
+    ring->blocks[a].tokens = (long long *) malloc(PREFETCH_TOKENS * sizeof(long long));
+    ring->blocks[a].infos = (struct sentence_info *) malloc(PREFETCH_SENTENCES * sizeof(struct sentence_info));
+    if (ring->blocks[a].tokens == NULL || ring->blocks[a].infos == NULL) {
+      printf("Memory allocation failed (prefetch)\n");
+      exit(1);
+    }
+  }
+  ring->head = ring->tail = ring->full = 0;
+  ring->next = -1;
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  pthread_create(&ring->thread, NULL, PrefetchThread, ring);
+}
+
+// Points sen to the next sentence read ahead, waiting for its block if need be; returns 0 at the end of the
+// thread's chunks
+int NextPrefetched(struct prefetch_ring *ring, long long **sen, struct sentence_info *info) {
+  struct prefetch_block *blk;
+  while (1) {
+    if (ring->next < 0) {
+      pthread_mutex_lock(&ring->lock);
+      while (ring->full == 0) pthread_cond_wait(&ring->cond, &ring->lock);
+      pthread_mutex_unlock(&ring->lock);
+      ring->next = 0;
+      ring->offset = 0;
+    }
+    blk = &ring->blocks[ring->tail];
+    if (ring->next < blk->num) break;
+    if (blk->last) return 0;
+    // hand the block back to the reader
+    ring->next = -1;
+    ring->tail = (ring->tail + 1) % prefetch;
+    pthread_mutex_lock(&ring->lock);
+    ring->full--;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  *info = blk->infos[ring->next++];
+  *sen = blk->tokens + ring->offset;
+  ring->offset += info->length;
+  return 1;
+}
+
+void StopPrefetch(struct prefetch_ring *ring) {
+  int a;
+  pthread_join(ring->thread, NULL);
+  CloseSentenceReader(&ring->reader);
+  for (a = 0; a < prefetch; a++) {
+    free(ring->blocks[a].tokens);
+    free(ring->blocks[a].infos);
+  }
+  free(ring->blocks);
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+}
+
+// Reads the word pairs of every -eval-sim file: lines of two words and the human score, the first number among the
+// fields that follow, split at tabs, else at commas, else at spaces (WordSim353 csv, MEN and SimLex-999 files alike).
+// Lines without a score, such as headers, are skipped, and the words are lowercased, as sim.py does.
+void LoadSimSets() {
+  char line[MAX_STRING * 10], *field[16], *save, *end, *p;
+  const char *delim;
+  long long w[2];
+  int a, b, n, max;
+  real score = 0;
+  struct sim_set *set;
+  FILE *fin;
+  sim_sets = (struct sim_set *) calloc(num_eval_sim, sizeof(struct sim_set));
+  for (a = 0; a < num_eval_sim; a++) {
+    set = &sim_sets[a];
+    max = 1000;
+    set->words = (long long *) malloc(2 * max * sizeof(long long));
+    set->gold = (real *) malloc(max * sizeof(real));
+    fin = fopen(eval_sim[a], "r");
+    if (fin == NULL) {
+      printf("ERROR: cannot read -eval-sim file %s\n", eval_sim[a]);
+      exit(1);
+    }
+    while (fgets(line, sizeof(line), fin) != NULL) {
+      delim = strchr(line, '\t') ? "\t\r\n" : strchr(line, ',') ? ",\r\n" : " \r\n";
+      for (n = 0, p = strtok_r(line, delim, &save); p != NULL && n < 16; p = strtok_r(NULL, delim, &save))
+        field[n++] = p;
+      for (b = 2; b < n; b++) {
+        score = strtod(field[b], &end);
+        if (end != field[b] && *end == 0) break;
+      }
+      if (b >= n) continue;
+      set->total++;
+      for (b = 0; b < 2; b++) {
+        for (p = field[b]; *p; p++) *p = tolower(*p);
+        w[b] = SearchVocab(field[b]);
+      }
+      if (w[0] < 0 || w[1] < 0) continue;
+      if (set->num == max) {
+        max *= 2;
+        set->words = (long long *) realloc(set->words, 2 * max * sizeof(long long));
+        set->gold = (real *) realloc(set->gold, max * sizeof(real));
+      }
+      set->words[2 * set->num] = w[0];
+      set->words[2 * set->num + 1] = w[1];
+      set->gold[set->num++] = score;
+    }
+    fclose(fin);
+    if (debug_mode > 0) printf("Evaluation pairs of %s: %d/%d in the vocabulary\n", eval_sim[a], set->num, set->total);
+  }
+}
+
+int LabelCompare(const void *a, const void *b) {
+  return (*(long long *) a > *(long long *) b) - (*(long long *) a < *(long long *) b);
+}
+
+// Reads the label of every document from -eval-labels, one integer per line as in the label.txt of the datasets, and
+// samples -eval-docs documents spread evenly over the corpus for clustering
+void LoadEvalLabels() {
+  long long a, *labels = (long long *) malloc(corpus_size * sizeof(long long)), *sorted, *found;
+  FILE *fin = fopen(eval_labels, "r");
+  if (fin == NULL) {
+    printf("ERROR: cannot read -eval-labels file %s\n", eval_labels);
+    exit(1);
+  }
+  for (a = 0; a < corpus_size; a++) if (fscanf(fin, "%lld", &labels[a]) != 1) break;
+  fclose(fin);
+  if (a < corpus_size) {
+    printf("ERROR: -eval-labels file %s has %lld labels for %lld documents\n", eval_labels, a, corpus_size);
+    exit(1);
+  }
+  eval_num_docs = eval_docs < corpus_size ? eval_docs : corpus_size;
+  eval_doc_ids = (long long *) malloc(eval_num_docs * sizeof(long long));
+  eval_doc_labels = (int *) malloc(eval_num_docs * sizeof(int));
+  sorted = (long long *) malloc(eval_num_docs * sizeof(long long));
+  for (a = 0; a < eval_num_docs; a++) {
+    eval_doc_ids[a] = a * corpus_size / eval_num_docs;
+    sorted[a] = labels[eval_doc_ids[a]];
+  }
+  // number the labels of the sample from 0
+  qsort(sorted, eval_num_docs, sizeof(long long), LabelCompare);
+  for (a = 0; a < eval_num_docs; a++)
+    if (a == 0 || sorted[a] != sorted[eval_num_labels - 1]) sorted[eval_num_labels++] = sorted[a];
+  for (a = 0; a < eval_num_docs; a++) {
+    found = (long long *) bsearch(&labels[eval_doc_ids[a]], sorted, eval_num_labels, sizeof(long long), LabelCompare);
+    eval_doc_labels[a] = found - sorted;
+  }
+  if (eval_k <= 0) eval_k = eval_num_labels;
+  if (eval_k > eval_num_docs) eval_k = eval_num_docs;
+  eval_vecs = (real *) malloc(eval_num_docs * layer1_size * sizeof(real));
+  eval_centroids = (real *) malloc(eval_k * layer1_size * sizeof(real));
+  eval_assign = (int *) malloc(eval_num_docs * sizeof(int));
+  if (debug_mode > 0) printf("Evaluation documents: %lld with %d labels, in %d clusters\n", eval_num_docs,
+                             eval_num_labels, eval_k);
+  free(labels);
+  free(sorted);
+}
+
+struct rank_item {
+  real value;
+  int index;
+};
+
+int RankItemCompare(const void *a, const void *b) {
+  real x = ((struct rank_item *) a)->value, y = ((struct rank_item *) b)->value;
+  return (x > y) - (x < y);
+}
+
+// Spearman's rank correlation of x and y: the Pearson correlation of their ranks, tied values sharing their mean rank
+real Spearman(real *x, real *y, int n) {
+  struct rank_item *items = (struct rank_item *) malloc(n * sizeof(struct rank_item));
+  double *ranks = (double *) malloc(2 * n * sizeof(double)), mean = (n + 1) / 2.0, sxy = 0, sxx = 0, syy = 0;
+  int a, b, c, v;
+  for (v = 0; v < 2; v++) {
+    for (a = 0; a < n; a++) {
+      items[a].value = v ? y[a] : x[a];
+      items[a].index = a;
+    }
+    qsort(items, n, sizeof(struct rank_item), RankItemCompare);
+    for (a = 0; a < n; a = b) {
+      for (b = a + 1; b < n && items[b].value == items[a].value; b++);
+      for (c = a; c < b; c++) ranks[v * n + items[c].index] = (a + b + 1) / 2.0;
+    }
+  }
+  for (a = 0; a < n; a++) {
+    sxy += (ranks[a] - mean) * (ranks[n + a] - mean);
+    sxx += (ranks[a] - mean) * (ranks[a] - mean);
+    syy += (ranks[n + a] - mean) * (ranks[n + a] - mean);
+  }
+  free(items);
+  free(ranks);
+  return sxx > 0 && syy > 0 ? sxy / sqrt(sxx * syy) : 0;
+}
+
+// Spearman correlation of the cosine similarities of the word vectors with the human scores of a dataset
+real SimCorrelation(struct sim_set *set) {
+  real *pred = (real *) malloc((set->num + 1) * sizeof(real)), *u, *v, r;
+  int a;
+  for (a = 0; a < set->num; a++) {
+    u = syn0 + set->words[2 * a] * layer1_size;
+    v = syn0 + set->words[2 * a + 1] * layer1_size;
+    pred[a] = Dot(u, v, layer1_size) / (sqrt(Dot(u, u, layer1_size) * Dot(v, v, layer1_size)) + 1e-12);
+  }
+  r = Spearman(pred, set->gold, set->num);
+  free(pred);
+  return r;
+}
+
+// Assigns the sampled documents id, id + num_threads, ... to their most similar centroid
+void *KMeansThread(void *id) {
+  long long a, b, best;
+  real *sims = (real *) malloc(eval_k * sizeof(real));
+  for (a = (long long) id; a < eval_num_docs; a += num_threads) {
+    MatVec(eval_centroids, eval_k, eval_vecs + a * layer1_size, sims, layer1_size);
+    for (b = 1, best = 0; b < eval_k; b++) if (sims[b] > sims[best]) best = b;
+    if (eval_assign[a] != best) {
+      eval_assign[a] = best;
+      __sync_fetch_and_add(&eval_changed, 1);
+    }
+  }
+  free(sims);
+  pthread_exit(NULL);
+}
+
+// Clusters the sampled document vectors by spherical k-means: Lloyd iterations of cosine assignment (in num_threads
+// threads) and renormalised means, seeded with the same documents every epoch so that epochs compare on equal terms.
+// Returns the normalised mutual information of clusters and labels (arithmetic mean of the entropies, as the default
+// of scikit-learn that cluster.py reports).
+real ClusterNMI() {
+  long long a, b, c, *count = (long long *) calloc((eval_k + 1) * (eval_num_labels + 1), sizeof(long long));
+  long long *picks = (long long *) malloc(eval_num_docs * sizeof(long long));
+  long long *size = (long long *) malloc(eval_k * sizeof(long long));
+  unsigned long long next_random = 1;
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  real *x, *y, norm;
+  double mi = 0, ha = 0, hb = 0, n = eval_num_docs, p;
+  for (a = 0; a < eval_num_docs; a++) {
+    x = eval_vecs + a * layer1_size;
+    y = DocRow(eval_doc_ids[a], x, 1);
+    if (y != x) memcpy(x, y, layer1_size * sizeof(real));
+    norm = sqrt(Dot(x, x, layer1_size));
+    if (norm > 0) ScaleRow(x, 1 / norm, layer1_size);
+    eval_assign[a] = -1;
+    picks[a] = a;
+  }
+  for (a = 0; a < eval_k; a++) {
+    next_random = next_random * (unsigned long long) 25214903917 + 11;
+    b = a + (next_random >> 16) % (eval_num_docs - a);
+    c = picks[a];
+    picks[a] = picks[b];
+    picks[b] = c;
+    memcpy(eval_centroids + a * layer1_size, eval_vecs + picks[a] * layer1_size, layer1_size * sizeof(real));
+  }
+  for (c = 0; c < KMEANS_ITER; c++) {
+    eval_changed = 0;
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, KMeansThread, (void *) a);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    if (eval_changed == 0) break;
+    // an empty cluster keeps its centroid
+    memset(size, 0, eval_k * sizeof(long long));
+    for (a = 0; a < eval_num_docs; a++) size[eval_assign[a]]++;
+    for (a = 0; a < eval_k; a++)
+      if (size[a] > 0) memset(eval_centroids + a * layer1_size, 0, layer1_size * sizeof(real));
+    for (a = 0; a < eval_num_docs; a++) {
+      x = eval_centroids + eval_assign[a] * layer1_size;
+      y = eval_vecs + a * layer1_size;
+      for (b = 0; b < layer1_size; b++) x[b] += y[b];
+    }
+    for (a = 0; a < eval_k; a++) {
+      x = eval_centroids + a * layer1_size;
+      norm = sqrt(Dot(x, x, layer1_size));
+      if (size[a] > 0 && norm > 0) ScaleRow(x, 1 / norm, layer1_size);
+    }
+  }
+  // contingency table of clusters and labels, with the cluster sizes in its last column and the label sizes in its
+  // last row
+  for (a = 0; a < eval_num_docs; a++) {
+    count[eval_assign[a] * (eval_num_labels + 1) + eval_doc_labels[a]]++;
+    count[eval_assign[a] * (eval_num_labels + 1) + eval_num_labels]++;
+    count[eval_k * (eval_num_labels + 1) + eval_doc_labels[a]]++;
+  }
+  for (a = 0; a < eval_k; a++)
+    for (b = 0; b < eval_num_labels; b++)
+      if ((c = count[a * (eval_num_labels + 1) + b]) > 0)
+        mi += c / n * log(n * c / count[a * (eval_num_labels + 1) + eval_num_labels] /
+                          count[eval_k * (eval_num_labels + 1) + b]);
+  for (a = 0; a < eval_k; a++)
+    if ((p = count[a * (eval_num_labels + 1) + eval_num_labels] / n) > 0) ha -= p * log(p);
+  for (b = 0; b < eval_num_labels; b++)
+    if ((p = count[eval_k * (eval_num_labels + 1) + b] / n) > 0) hb -= p * log(p);
+  free(count);
+  free(picks);
+  free(size);
+  free(pt);
+  return ha + hb > 0 ? 2 * mi / (ha + hb) : 1;
+}
+
+// Evaluates the model after epoch (counted from 0) while the training threads wait: prints the mean objectives of
+// the epoch, the Spearman correlation of every -eval-sim dataset and the NMI of clustering the -eval-labels sample.
+// Their mean is the score of the epoch (the negated objective (w) + (d) without them), which -early-stop watches.
+void EvaluateEpoch(long long epoch) {
+  double obj_w = 0, obj_d = 0, score = 0;
+  real r;
+  int a, n = 0;
+  if (epoch_steps[epoch] > 0) {
+    obj_w = epoch_obj[2 * epoch] / epoch_steps[epoch];
+    obj_d = epoch_obj[2 * epoch + 1] / epoch_steps[epoch];
+  }
+  // on a line of its own after the progress line
+  if (debug_mode > 0) printf("%sEpoch %lld  Objective (w): %f  Objective (d): %f", debug_mode > 1 ? "\n" : "",
+                             epoch + 1, obj_w, obj_d);
+  for (a = 0; a < num_eval_sim; a++) {
+    r = SimCorrelation(&sim_sets[a]);
+    if (debug_mode > 0) printf("  %s: %.4f", eval_sim[a], r);
+    score += r;
+    n++;
+  }
+  if (eval_num_docs > 0) {
+    r = ClusterNMI();
+    if (debug_mode > 0) printf("  NMI: %.4f", r);
+    score += r;
+    n++;
+  }
+  score = n > 0 ? score / n : -(obj_w + obj_d);
+  if (eval_best_epoch < 0 || score > eval_best + early_stop_delta) {
+    eval_best = score;
+    eval_best_epoch = epoch;
+    eval_bad = 0;
+  } else eval_bad++;
+  if (debug_mode > 0) printf("\n");
+  if (early_stop > 0 && eval_bad >= early_stop && epoch < iter - 1) {
+    stop_training = 1;
+    if (debug_mode > 0) printf("Early stop: no improvement over epoch %lld for %d epochs\n", eval_best_epoch + 1,
+                               eval_bad);
+  }
+  fflush(stdout);
+}
+
+// Adds a training thread's objectives of pass over the corpus to its epoch and clears them
+void AddEpochObjective(long long pass, double *obj_w, double *obj_d, long long *steps) {
+  if (pass < 0) return;
+  pthread_mutex_lock(&eval_lock);
+  epoch_obj[2 * pass] += *obj_w;
+  epoch_obj[2 * pass + 1] += *obj_d;
+  epoch_steps[pass] += *steps;
+  pthread_mutex_unlock(&eval_lock);
+  *obj_w = *obj_d = 0;
+  *steps = 0;
+}
+
+// Called by the training threads every 10000 words once an evaluation is due. The first to get here waits until
+// the others have too (or have finished), evaluates the model and then lets them all go on.
+void EpochBarrier() {
+  long long epoch;
+  pthread_mutex_lock(&eval_lock);
+  eval_parked++;
+  if (eval_pending) {
+    pthread_cond_broadcast(&eval_cond);
+    while (eval_pending) pthread_cond_wait(&eval_cond, &eval_lock);
+  } else if (eval_next > 0 && word_count_actual >= eval_next) {
+    eval_pending = 1;
+    while (eval_parked + eval_finished < num_threads) pthread_cond_wait(&eval_cond, &eval_lock);
+    epoch = word_count_actual / train_words - 1;
+    if (epoch > iter - 2) epoch = iter - 2;
+    pthread_mutex_unlock(&eval_lock);
+    EvaluateEpoch(epoch);
+    pthread_mutex_lock(&eval_lock);
+    // the last epoch is evaluated once training is done
+    eval_next = epoch + 2 < iter ? (epoch + 2) * train_words : 0;
+    eval_pending = 0;
+    pthread_cond_broadcast(&eval_cond);
+  }
+  eval_parked--;
+  pthread_mutex_unlock(&eval_lock);
+}
+
+void FreeEvalData() {
+  int a;
+  for (a = 0; sim_sets != NULL && a < num_eval_sim; a++) {
+    free(sim_sets[a].words);
+    free(sim_sets[a].gold);
+  }
+  free(sim_sets);
+  free(eval_doc_ids);
+  free(eval_doc_labels);
+  free(eval_assign);
+  free(eval_vecs);
+  free(eval_centroids);
+  free(epoch_obj);
+  free(epoch_steps);
+  sim_sets = NULL;
+  eval_doc_ids = NULL;
+  eval_doc_labels = eval_assign = NULL;
+  eval_vecs = eval_centroids = NULL;
+  epoch_obj = NULL;
+  epoch_steps = NULL;
+}
+
+// Counts a training thread as finished for the epoch barrier; also run when an error ends the thread in the library
+void TrainingThreadDone(void *arg) {
+  pthread_mutex_lock(&eval_lock);
+  eval_finished++;
+  pthread_cond_broadcast(&eval_cond);
+  pthread_mutex_unlock(&eval_lock);
+}
+
+// Prints the mean objectives per center word of every epoch trained
+void ReportEpochs() {
+  long long a;
+  printf("\nEpoch  Objective (w)  Objective (d)\n");
+  for (a = 0; a < iter; a++)
+    if (epoch_steps[a] > 0)
+      printf("%5lld  %13f  %13f\n", a + 1, epoch_obj[2 * a] / epoch_steps[a], epoch_obj[2 * a + 1] / epoch_steps[a]);
+  if (eval_best_epoch >= 0) printf("Best evaluated epoch: %lld\n", eval_best_epoch + 1);
+}
+
+void *TrainModelThread(void *id) {
+  long long a, b, d, doc = 0, word, last_word, sentence_length = 0, sentence_position = 0;
+  long long word_count = 0, last_word_count = 0, sen_buf[MAX_SENTENCE_LENGTH + 1], *sen = sen_buf;
+  long long l1, c, target;
+  unsigned long long next_random = (long long) id;
+  struct sentence_reader reader;
+  struct sentence_info info;
+  struct prefetch_ring ring;
+  int more;
+  struct neg_sampler ns;
+  struct margin_counts mc_w = {0, 0}, mc_d = {0, 0};
+  struct thread_stats *stats = &thread_stats[(long long) id];
+  real f, h, obj_w = 0, obj_d = 0, *pos, *neg, *ctx = NULL;
+  struct hot_cache hot = {NULL, NULL};
+  // objectives summed over the center words since the last report, and wall clock
+  double sum_obj_w = 0, sum_obj_d = 0, thread_start = WallTime(), read_start, read_time = 0;
+  long long steps = 0;
+  // and since they were last added to the epoch of pass
+  double pass_obj_w = 0, pass_obj_d = 0;
+  long long pass = -1, pass_steps = 0;
+  real *neu1e = (real *) calloc(layer1_size, sizeof(real));
+  // the document vector of the current sentence; a half-precision one is converted once per sentence, and merged
+  // back from doc_buf with the copy it was loaded as (doc_base)
+  real *doc_buf = (real *) malloc(3 * layer1_size * sizeof(real)), *doc_row = NULL;
+  real *doc_base = doc_buf + layer1_size, *doc_merge = doc_buf + 2 * layer1_size;
+  // minibatch buffers: every context of a window plus its negatives
+  int batch_rows = 0, max_batch_rows = 2 * window * (negative + 1);
+  real **rows = NULL;
+  int *owner = NULL;
+  real *blk = NULL, *sims = NULL, *coef = NULL;
+  pthread_cleanup_push(TrainingThreadDone, NULL);
+  if (batch) {
+    rows = (real **) malloc(max_batch_rows * sizeof(real *));
+    owner = (int *) malloc(max_batch_rows * sizeof(int));
+    sims = (real *) malloc(max_batch_rows * sizeof(real));
+    coef = (real *) malloc(3 * max_batch_rows * sizeof(real));
+    a = posix_memalign((void **) &blk, 128, (long long) max_batch_rows * layer1_size * sizeof(real));
+    if (blk == NULL) {
+      printf("Memory allocation failed (batch)\n");
+      exit(1);
+    }
+  }
+  struct thread_state *state = thread_states != NULL ? &thread_states[(long long) id] : NULL;
+  if (numa) PinThread((long long) id);
+  // after pinning, so that the private copies are local to the thread's node
+  if (hot_rows > 0) InitHotCache(&hot);
+  if (resume && state->chunk >= 0) {
+    // continue from the sentence the thread was at when the checkpoint was taken
+    word_count = last_word_count = state->word_count;
+    next_random = state->next_random;
+  }
+  // without -prefetch the thread reads its input itself, subsampling with its own generator
+  if (prefetch) StartPrefetch(&ring, (long long) id, next_random);
+  else OpenSentenceReader(&reader, (long long) id, &next_random);
+  InitNegSampler(&ns, next_random);
+
+  while (1) {
+    if (word_count - last_word_count > 10000) {
+      word_count_actual += word_count - last_word_count;
+      last_word_count = word_count;
+      stats->words = word_count;
+      stats->read_time = read_time;
+      stats->busy_time = WallTime() - thread_start;
+      stats->pairs_w = mc_w.pairs;
+      stats->violations_w = mc_w.violations;
+      stats->pairs_d = mc_d.pairs;
+      stats->violations_d = mc_d.violations;
+      if (steps > 0) {
+        stats->obj_w = sum_obj_w / steps;
+        stats->obj_d = sum_obj_d / steps;
+      }
+      sum_obj_w = sum_obj_d = 0;
+      steps = 0;
+      if (hot_rows > 0) MergeHotCache(&hot, (long long) id);
+      AddEpochObjective(pass, &pass_obj_w, &pass_obj_d, &pass_steps);
+      if (eval_pending || (eval_next > 0 && word_count_actual >= eval_next)) EpochBarrier();
+      if (stop_training) break;
+      if ((debug_mode > 1)) PrintProgress();
+      alpha = starting_alpha * (1 - word_count_actual / (real) (iter * train_words + 1));
+      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+    }
+    if (sentence_length == 0) {
+      // with -prefetch this is the time spent waiting for the reader thread
+      read_start = WallTime();
+      if (prefetch) more = NextPrefetched(&ring, &sen, &info);
+      else more = ReadSentence(&reader, sen, &info);
+      if (!more) break;
+      if (info.pass != pass) {
+        AddEpochObjective(pass, &pass_obj_w, &pass_obj_d, &pass_steps);
+        pass = info.pass;
+      }
+      if (doc_row != NULL && doc_precision) MergeDocRow(doc, doc_row, doc_base, doc_merge);
+      doc = info.doc;
+      doc_row = DocRow(doc, doc_buf, 1);
+      if (doc_precision) memcpy(doc_base, doc_row, layer1_size * sizeof(real));
+      if (state != NULL) {
+        OpenStateSection((long long) id);
+        state->chunk = info.state.chunk;
+        state->pos = info.state.pos;
+        state->doc = info.state.doc;
+        state->word_count = word_count;
+        state->next_random = info.state.next_random;
+        CloseStateSection((long long) id);
+      }
+      word_count += info.words;
+      sentence_length = info.length;
+      sentence_position = 0;
+      read_time += WallTime() - read_start;
+      if (sentence_length == 0) continue;
+    }
+
+    word = sen[sentence_position];
+    if (word == -1) continue;
+    next_random = next_random * (unsigned long long) 25214903917 + 11;
+    b = next_random % window;
+
+    if (batch) {
+      batch_rows = 0;
+      for (a = b; a < window * 2 + 1 - b; a++)
+        if (a != window) {
+          c = sentence_position - window + a;
+          if (c < 0) continue;
+          if (c >= sentence_length) continue;
+          last_word = sen[c];
+          if (last_word == -1) continue;
+          l1 = batch_rows;
+          rows[batch_rows] = WordRow(&hot, last_word); // positive center word u
+          owner[batch_rows++] = -1;
+          for (d = 1; d < negative + 1; d++) {
+            target = DrawNegative(&ns, &next_random);
+            if (target == word) continue;
+            rows[batch_rows] = WordRow(&hot, target); // negative center word u'
+            owner[batch_rows++] = l1;
+          }
+        }
+      obj_w = BatchMarginUpdate(rows, owner, batch_rows, ContextRow(&hot, word), blk, sims, coef, neu1e, alpha,
+                                layer1_size, &mc_w);
+
+      batch_rows = 0;
+      rows[batch_rows] = WordRow(&hot, word); // positive center word u
+      owner[batch_rows++] = -1;
+      for (d = 1; d < negative + 1; d++) {
+        target = DrawNegative(&ns, &next_random);
+        if (target == word) continue;
+        rows[batch_rows] = WordRow(&hot, target); // negative center word u'
+        owner[batch_rows++] = 0;
+      }
+      obj_d = BatchMarginUpdate(rows, owner, batch_rows, doc_row, blk, sims, coef, neu1e, alpha, layer1_size, &mc_d);
+      sum_obj_w += obj_w;
+      sum_obj_d += obj_d;
+      steps++;
+      pass_obj_w += obj_w;
+      pass_obj_d += obj_d;
+      pass_steps++;
+
+      sentence_position++;
+      if (sentence_position >= sentence_length) sentence_length = 0;
+      continue;
+    }
+
+    // the objective of the center word sums over all its contexts
+    obj_w = 0;
+    for (a = b; a < window * 2 + 1 - b; a++)
+      if (a != window) {
+        c = sentence_position - window + a;
+        if (c < 0) continue;
+        if (c >= sentence_length) continue;
+        last_word = sen[c];
+        if (last_word == -1) continue;
+        pos = WordRow(&hot, last_word); // positive center word u
+
+        for (d = 0; d < negative + 1; d++) {
+          if (d == 0) {
+            ctx = ContextRow(&hot, word); // positive context word v
+          } else {
+            target = DrawNegative(&ns, &next_random);
+            if (target == word) continue;
+            neg = WordRow(&hot, target); // negative center word u'
+            // f = cos(v, u) = v * u, h = cos(v, u') = v * u'
+            Dot2(pos, neg, ctx, layer1_size, &f, &h);
+            mc_w.pairs++;
+            if (f - h < margin) {
+              mc_w.violations++;
+              obj_w += margin - (f - h);
+              // update positive center word, negative center word and context word
+              MarginUpdate(pos, neg, ctx, neu1e, f, h, alpha, layer1_size);
+            }
+          }
+        }
+      }
+
+    obj_d = DocumentStep(word, doc_row, &hot, &ns, &next_random, neu1e, alpha, 0, &mc_d);
+    sum_obj_w += obj_w;
+    sum_obj_d += obj_d;
+    steps++;
+    pass_obj_w += obj_w;
+    pass_obj_d += obj_d;
+    pass_steps++;
+
+    sentence_position++;
+    if (sentence_position >= sentence_length) {
+      sentence_length = 0;
+      continue;
+    }
+  }
+  word_count_actual += word_count - last_word_count;
+  if (doc_row != NULL && doc_precision) MergeDocRow(doc, doc_row, doc_base, doc_merge);
+  if (hot_rows > 0) MergeHotCache(&hot, (long long) id);
+  AddEpochObjective(pass, &pass_obj_w, &pass_obj_d, &pass_steps);
+  if (state != NULL) {
+    OpenStateSection((long long) id);
+    state->chunk = -1;
+    CloseStateSection((long long) id);
+  }
+  stats->words = word_count;
+  stats->read_time = read_time;
+  stats->pairs_w = mc_w.pairs;
+  stats->violations_w = mc_w.violations;
+  stats->pairs_d = mc_d.pairs;
+  stats->violations_d = mc_d.violations;
+  stats->finish_time = WallTime();
+  stats->busy_time = stats->finish_time - thread_start;
+  if (prefetch) {
+    // after an early stop the reader thread still finishes its chunk
+    while (NextPrefetched(&ring, &sen, &info));
+    StopPrefetch(&ring);
+  } else CloseSentenceReader(&reader);
+  free(neu1e);
+  free(doc_buf);
+  free(rows);
+  free(owner);
+  free(sims);
+  free(coef);
+  free(blk);
+  free(hot.rows);
+  free(hot.base);
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
+// Infers the vectors of one block of documents (held in infer_tokens) for the documents id, id + num_threads, ...
+// with the word vectors frozen, decaying the learning rate linearly over the iterations
+void *InferThread(void *id) {
+  long long d, t, word, my_docs = 0, done = 0, local_iter;
+  unsigned long long next_random = (long long) id;
+  struct neg_sampler ns;
+  struct margin_counts mc = {0, 0};
+  real lr, *buf = (real *) malloc(layer1_size * sizeof(real)), *row;
+  InitNegSampler(&ns, next_random);
+  for (d = (long long) id; d < infer_num_docs; d += num_threads) my_docs++;
+  for (local_iter = 0; local_iter < iter; local_iter++) {
+    for (d = (long long) id; d < infer_num_docs; d += num_threads, done++) {
+      lr = starting_alpha * (1 - done / (real) (iter * my_docs + 1));
+      if (lr < starting_alpha * 0.0001) lr = starting_alpha * 0.0001;
+      row = DocRow(d, buf, 1);
+      for (t = infer_doc_starts[d]; t < infer_doc_starts[d + 1]; t++) {
+        word = infer_tokens[t];
+        if (sample > 0) {
+          real ran = (sqrt(vocab[word].cn / (sample * corpus_words)) + 1) * (sample * corpus_words) /
+                     vocab[word].cn;
+          next_random = next_random * (unsigned long long) 25214903917 + 11;
+          if (ran < (next_random & 0xFFFF) / (real) 65536) continue;
+        }
+        DocumentStep(word, row, NULL, &ns, &next_random, NULL, lr, 1, &mc);
+      }
+      StoreDocRow(d, row);
+    }
+  }
+  free(buf);
+  pthread_exit(NULL);
+}
+
+// Embeds the documents of the input file (or stdin for "-") against frozen word vectors, reading, inferring and
+// writing infer_block documents at a time so that memory does not grow with the input
+void InferDocs() {
+  long long a, b, word, first_doc = 0, num_tokens = 0, tokens_max = 1 << 20;
+  unsigned long long next_random;
+  real norm, *buf = (real *) malloc(layer1_size * sizeof(real)), *row;
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  FILE *fin = strcmp(train_file, "-") ? fopen(train_file, "rb") : stdin;
+  FILE *fo = doc_output[0] != 0 ? StartEmbFile(doc_output, -1, 0) : NULL;
+  if (fin == NULL) {
+    printf("ERROR: input file not found!\n");
+    exit(1);
+  }
+  infer_tokens = (int *) malloc(tokens_max * sizeof(int));
+  infer_doc_starts = (long long *) malloc((infer_block + 1) * sizeof(long long));
+  while (!feof(fin)) {
+    // read the next block of documents
+    infer_num_docs = 0;
+    num_tokens = 0;
+    infer_doc_starts[0] = 0;
+    while (infer_num_docs < infer_block) {
+      word = ReadWordIndex(fin);
+      if (feof(fin)) {
+        if (num_tokens > infer_doc_starts[infer_num_docs]) infer_doc_starts[++infer_num_docs] = num_tokens;
+        break;
+      }
+      if (word == -1) continue;
+      if (word == 0) {
+        infer_doc_starts[++infer_num_docs] = num_tokens;
+        continue;
+      }
+      if (num_tokens == tokens_max) {
+        tokens_max *= 2;
+        infer_tokens = (int *) realloc(infer_tokens, tokens_max * sizeof(int));
+      }
+      infer_tokens[num_tokens++] = word;
+    }
+    if (infer_num_docs == 0) break;
+    // every document starts from its own pseudo-random point on the sphere
+    for (a = 0; a < infer_num_docs; a++) {
+      next_random = first_doc + a + 1;
+      row = DocRow(a, buf, 0);
+      norm = 0.0;
+      for (b = 0; b < layer1_size; b++) {
+        next_random = next_random * (unsigned long long) 25214903917 + 11;
+        row[b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+        norm += row[b] * row[b];
+      }
+      for (b = 0; b < layer1_size; b++) row[b] /= sqrt(norm);
+      StoreDocRow(a, row);
+    }
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, InferThread, (void *) a);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    CheckThreads();
+    if (fo != NULL) WriteDocRows(fo, first_doc, infer_num_docs);
+    else {
+      infer_docs = (real *) realloc(infer_docs, (first_doc + infer_num_docs) * layer1_size * sizeof(real));
+      for (a = 0; a < infer_num_docs; a++)
+        memcpy(infer_docs + (first_doc + a) * layer1_size, DocRow(a, buf, 1), layer1_size * sizeof(real));
+    }
+    first_doc += infer_num_docs;
+    if (debug_mode > 1) {
+      printf("%cDocuments: %lld", 13, first_doc);
+      fflush(stdout);
+    }
+  }
+  if (debug_mode > 0) printf("%cInferred %lld documents\n", 13, first_doc);
+  if (fo != NULL) FinishEmbFile(fo, doc_output, first_doc);
+  infer_rows = first_doc;
+  if (fin != stdin) fclose(fin);
+  free(infer_tokens);
+  free(buf);
+  free(infer_doc_starts);
+  free(pt);
+}
+
+// Loads a whole embedding file as written by SaveEmb and returns its rows x dim matrix, setting layer1_size to dim.
+// Binary files are used in place from their memory map, which stays open until exit. With named set, the row
+// names are added to the vocabulary in row order, so that row a is vocabulary entry a.
+real *ReadEmbMatrix(char *file, long long *rows, int named) {
+  long long a, b, dim;
+  char word[MAX_STRING], *name;
+  real *emb = NULL;
+  struct emb_map map;
+  FILE *fin;
+  if (debug_mode > 0) fprintf(stderr, "Loading embedding from file %s\n", file);
+  if (MapEmb(file, &map)) {
+    if (named && map.names == NULL) {
+      printf("ERROR: %s has no row names\n", file);
+      exit(1);
+    }
+    *rows = map.header.rows;
+    dim = map.header.dim;
+    emb = map.data;
+    madvise(map.map, map.map_size, MADV_WILLNEED);
+    if (named) for (a = 0, name = map.names; a < *rows; a++, name += strlen(name) + 1) AddWordToVocab(name);
+  } else {
+    fin = fopen(file, "r");
+    if (fin == NULL || fscanf(fin, "%lld %lld", rows, &dim) != 2) {
+      printf("ERROR: cannot read embedding file %s\n", file);
+      exit(1);
+    }
+    a = posix_memalign((void **) &emb, 128, *rows * dim * sizeof(real));
+    if (emb == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    for (a = 0; a < *rows; a++) {
+      if (fscanf(fin, "%s", word) != 1) break;
+      if (named) AddWordToVocab(word);
+      for (b = 0; b < dim; b++) fscanf(fin, "%f", &emb[a * dim + b]);
+    }
+    fclose(fin);
+    if (a < *rows) {
+      printf("ERROR: embedding file %s is truncated\n", file);
+      exit(1);
+    }
+  }
+  layer1_size = dim;
+  return emb;
+}
+
+// Keeps the k best hits in a min-heap on score: hit replaces the worst one if it scores higher
+static inline void PushHit(struct query_hit *heap, int k, long long id, real score) {
+  int i = 0, c;
+  if (score <= heap[0].score) return;
+  while ((c = 2 * i + 1) < k) {
+    if (c + 1 < k && heap[c + 1].score < heap[c].score) c++;
+    if (heap[c].score >= score) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i].id = id;
+  heap[i].score = score;
+}
+
+int HitCompare(const void *a, const void *b) {
+  real d = ((struct query_hit *) b)->score - ((struct query_hit *) a)->score;
+  return (d > 0) - (d < 0);
+}
+
+// Scores the query_num queries against one contiguous range of target rows, QUERY_TILE_ROWS rows at a time so
+// that a tile stays in cache while every query of the block is multiplied with it, into one top-k heap per query
+void *QueryThread(void *id) {
+  long long a, q, r, begin, end, tile = QUERY_TILE_ROWS;
+  real sims[QUERY_TILE_ROWS];
+  struct query_hit *heaps = query_hits + (long long) id * query_num * top_k;
+  begin = (query_dst_rows + num_threads - 1) / num_threads * (long long) id;
+  end = begin + (query_dst_rows + num_threads - 1) / num_threads;
+  if (end > query_dst_rows) end = query_dst_rows;
+  for (a = 0; a < query_num * top_k; a++) {
+    heaps[a].id = -1;
+    heaps[a].score = -2;
+  }
+  for (r = begin; r < end; r += tile) {
+    if (r + tile > end) tile = end - r;
+    for (q = 0; q < query_num; q++) {
+      if (query_rows[q] < 0) continue;
+      MatVec(query_dst + r * layer1_size, tile, query_vecs + q * layer1_size, sims, layer1_size);
+      for (a = 0; a < tile; a++) {
+        // a word or document is not reported as its own neighbour
+        if (query_src == query_dst && r + a == query_rows[q]) continue;
+        PushHit(heaps + q * top_k, top_k, r + a, sims[a]);
+      }
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// Pushes a hit onto the min-heap on score heap[0, *num), growing it as needed
+static void HeapPush(struct query_hit **heap, int *num, int *max, long long id, real score) {
+  int i = (*num)++, p;
+  if (*num > *max) {
+    *max = *max * 2 + 16;
+    *heap = (struct query_hit *) realloc(*heap, *max * sizeof(struct query_hit));
+  }
+  for (; i > 0 && (*heap)[p = (i - 1) / 2].score > score; i = p) (*heap)[i] = (*heap)[p];
+  (*heap)[i].id = id;
+  (*heap)[i].score = score;
+}
+
+// Removes and returns the lowest scoring hit of the min-heap heap[0, *num)
+static struct query_hit HeapPop(struct query_hit *heap, int *num) {
+  struct query_hit top = heap[0], last = heap[--(*num)];
+  int i = 0, c;
+  while ((c = 2 * i + 1) < *num) {
+    if (c + 1 < *num && heap[c + 1].score < heap[c].score) c++;
+    if (heap[c].score >= last.score) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+// Returns the link list (a count followed by the neighbours) of node x at level
+static inline int *AnnLinks(long long x, int level) {
+  if (level == 0) return ann.links0 + x * (1 + 2 * ann.header.m);
+  return ann.links_upper + ann.upper_offsets[x] + (level - 1) * (1 + ann.header.m);
+}
+
+// While the graph is being built, link lists are guarded by one spinlock per node
+static inline void AnnLock(long long x) {
+  if (ann_locks != NULL) while (__sync_lock_test_and_set(&ann_locks[x], 1));
+}
+
+static inline void AnnUnlock(long long x) {
+  if (ann_locks != NULL) __sync_lock_release(&ann_locks[x]);
+}
+
+// Copies the link list of x at level into out and returns its length
+static inline int AnnCopyLinks(long long x, int level, int *out) {
+  int *links = AnnLinks(x, level), num;
+  AnnLock(x);
+  num = links[0];
+  memcpy(out, links + 1, num * sizeof(int));
+  AnnUnlock(x);
+  return num;
+}
+
+void InitAnnSearch(struct ann_search *search) {
+  memset(search, 0, sizeof(struct ann_search));
+  search->visited = (unsigned short *) calloc(ann.header.rows, sizeof(unsigned short));
+  if (search->visited == NULL) {
+    printf("Memory allocation failed (ann)\n");
+    exit(1);
+  }
+}
+
+void FreeAnnSearch(struct ann_search *search) {
+  free(search->visited);
+  free(search->cand);
+  free(search->res);
+}
+
+// Follows the single best neighbour of ep at level until no neighbour is closer to q; returns the final node
+long long AnnGreedy(const real *q, long long ep, real *ep_sim, int level) {
+  int a, num, links[1 + 2 * ann.header.m], changed = 1;
+  real sim;
+  while (changed) {
+    changed = 0;
+    num = AnnCopyLinks(ep, level, links);
+    for (a = 0; a < num; a++) {
+      sim = Dot(q, ann.vecs + links[a] * ann.header.dim, ann.header.dim);
+      if (sim > *ep_sim) {
+        *ep_sim = sim;
+        ep = links[a];
+        changed = 1;
+      }
+    }
+  }
+  return ep;
+}
+
+// Best-first search of level from ep, keeping the ef nodes most similar to q in search->res
+void AnnSearchLayer(struct ann_search *search, const real *q, long long ep, real ep_sim, int ef, int level) {
+  int a, num, links[1 + 2 * ann.header.m];
+  long long n;
+  real sim;
+  struct query_hit c;
+  if (++search->tag == 0) {
+    memset(search->visited, 0, ann.header.rows * sizeof(unsigned short));
+    search->tag = 1;
+  }
+  search->num_cand = search->num_res = 0;
+  search->visited[ep] = search->tag;
+  HeapPush(&search->cand, &search->num_cand, &search->max_cand, ep, -ep_sim);
+  HeapPush(&search->res, &search->num_res, &search->max_res, ep, ep_sim);
+  while (search->num_cand > 0) {
+    c = HeapPop(search->cand, &search->num_cand);
+    if (-c.score < search->res[0].score && search->num_res >= ef) break;
+    num = AnnCopyLinks(c.id, level, links);
+    for (a = 0; a < num; a++) {
+      n = links[a];
+      if (search->visited[n] == search->tag) continue;
+      search->visited[n] = search->tag;
+      sim = Dot(q, ann.vecs + n * ann.header.dim, ann.header.dim);
+      if (search->num_res < ef || sim > search->res[0].score) {
+        HeapPush(&search->cand, &search->num_cand, &search->max_cand, n, -sim);
+        HeapPush(&search->res, &search->num_res, &search->max_res, n, sim);
+        if (search->num_res > ef) HeapPop(search->res, &search->num_res);
+      }
+    }
+  }
+}
+
+// Picks up to max neighbours from cands (sorted by similarity to the base node, best first), skipping a candidate
+// that is more similar to an already picked neighbour than to the base, so that links spread in all directions
+int AnnSelect(struct query_hit *cands, int num, int max, int *out) {
+  int a, b, picked = 0;
+  for (a = 0; a < num && picked < max; a++) {
+    for (b = 0; b < picked; b++)
+      if (Dot(ann.vecs + cands[a].id * ann.header.dim, ann.vecs + out[b] * ann.header.dim, ann.header.dim) >
+          cands[a].score) break;
+    if (b == picked) out[picked++] = cands[a].id;
+  }
+  return picked;
+}
+
+// Adds the link e -> x at level, re-selecting the neighbours of e when its list is full
+void AnnConnect(long long e, long long x, int level, real sim) {
+  int a, *links = AnnLinks(e, level), max = level ? ann.header.m : 2 * ann.header.m;
+  struct query_hit cands[1 + 2 * ann.header.m];
+  AnnLock(e);
+  if (links[0] < max) links[++links[0]] = x;
+  else {
+    for (a = 0; a < links[0]; a++) {
+      cands[a].id = links[a + 1];
+      cands[a].score = Dot(ann.vecs + e * ann.header.dim, ann.vecs + cands[a].id * ann.header.dim, ann.header.dim);
+    }
+    cands[a].id = x;
+    cands[a].score = sim;
+    qsort(cands, links[0] + 1, sizeof(struct query_hit), HitCompare);
+    links[0] = AnnSelect(cands, links[0] + 1, max, links + 1);
+  }
+  AnnUnlock(e);
+}
+
+// Inserts node x into the graph; a node that raises the top level holds ann_lock until it has become the entry
+void AnnInsert(struct ann_search *search, long long x) {
+  int a, b, level = ann.levels[x], max_level, num, picked, links[ann.header.m];
+  long long ep;
+  real ep_sim;
+  const real *q = ann.vecs + x * ann.header.dim;
+  struct query_hit *cands;
+  pthread_mutex_lock(&ann_lock);
+  max_level = ann.header.max_level;
+  ep = ann.header.entry;
+  if (level <= max_level) pthread_mutex_unlock(&ann_lock);
+  ep_sim = Dot(q, ann.vecs + ep * ann.header.dim, ann.header.dim);
+  for (a = max_level; a > level; a--) ep = AnnGreedy(q, ep, &ep_sim, a);
+  for (a = level < max_level ? level : max_level; a >= 0; a--) {
+    AnnSearchLayer(search, q, ep, ep_sim, ann_ef_construction, a);
+    cands = search->res;
+    num = search->num_res;
+    qsort(cands, num, sizeof(struct query_hit), HitCompare);
+    ep = cands[0].id;
+    ep_sim = cands[0].score;
+    // other threads may reach x through a higher level and link to it at this one meanwhile, so the picked
+    // neighbours are linked back from a private copy
+    picked = AnnSelect(cands, num, ann.header.m, links);
+    AnnLock(x);
+    memcpy(AnnLinks(x, a) + 1, links, picked * sizeof(int));
+    AnnLinks(x, a)[0] = picked;
+    AnnUnlock(x);
+    for (b = 0; b < picked; b++)
+      AnnConnect(links[b], x, a, Dot(q, ann.vecs + links[b] * ann.header.dim, ann.header.dim));
+  }
+  if (level > max_level) {
+    ann.header.entry = x;
+    ann.header.max_level = level;
+    pthread_mutex_unlock(&ann_lock);
+  }
+}
+
+void *AnnBuildThread(void *id) {
+  long long x;
+  struct ann_search search;
+  InitAnnSearch(&search);
+  while ((x = __sync_fetch_and_add(&ann_next, 1)) < ann.header.rows) {
+    AnnInsert(&search, x);
+    if ((debug_mode > 1) && (x % 100000 == 0)) {
+      printf("%cIndexed: %lldK", 13, x / 1000);
+      fflush(stdout);
+    }
+  }
+  FreeAnnSearch(&search);
+  pthread_exit(NULL);
+}
+
+// Builds the nearest-neighbour graph over the rows x layer1_size unit vectors vecs with num_threads threads and
+// writes it to ann_file
+void BuildAnnIndex(real *vecs, long long rows) {
+  long long a, upper_size = 0;
+  unsigned long long next_random = 1;
+  double ml = 1 / log(ann_m);
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  FILE *fo;
+  double build_start = WallTime();
+  memset(&ann, 0, sizeof(ann));
+  memcpy(ann.header.magic, ANN_MAGIC, sizeof(ann.header.magic));
+  ann.header.rows = rows;
+  ann.header.dim = layer1_size;
+  ann.header.m = ann_m;
+  ann.vecs = vecs;
+  ann.levels = (int *) malloc(rows * sizeof(int));
+  ann.upper_offsets = (long long *) malloc(rows * sizeof(long long));
+  ann_locks = (int *) calloc(rows, sizeof(int));
+  // levels are drawn from an exponentially decaying distribution before the build, so every link list can be
+  // laid out in place
+  for (a = 0; a < rows; a++) {
+    next_random = next_random * (unsigned long long) 25214903917 + 11;
+    ann.levels[a] = (int) (-log(((next_random >> 16) % 65535 + 1) / 65536.0) * ml);
+    ann.upper_offsets[a] = upper_size;
+    upper_size += ann.levels[a] * (1 + ann_m);
+  }
+  ann.header.upper_size = upper_size;
+  ann.links0 = (int *) calloc(rows * (1 + 2 * ann_m), sizeof(int));
+  ann.links_upper = (int *) calloc(upper_size + 1, sizeof(int));
+  if (ann.links0 == NULL || ann.links_upper == NULL || ann_locks == NULL) {
+    printf("Memory allocation failed (ann)\n");
+    exit(1);
+  }
+  ann.header.entry = 0;
+  ann.header.max_level = ann.levels[0];
+  ann_next = 1;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, AnnBuildThread, (void *) a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  CheckThreads();
+  if (debug_mode > 0)
+    printf("%cIndexed %lld vectors in %.2fs\n", 13, rows, WallTime() - build_start);
+  fo = fopen(ann_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", ann_file);
+    exit(1);
+  }
+  fwrite(&ann.header, sizeof(ann.header), 1, fo);
+  fwrite(ann.upper_offsets, sizeof(long long), rows, fo);
+  fwrite(ann.levels, sizeof(int), rows, fo);
+  fwrite(ann.links0, sizeof(int), rows * (1 + 2 * ann_m), fo);
+  fwrite(ann.links_upper, sizeof(int), upper_size, fo);
+  if (ferror(fo) || fclose(fo) != 0) {
+    printf("ERROR: failed to write %s\n", ann_file);
+    exit(1);
+  }
+  free(ann.levels);
+  free(ann.upper_offsets);
+  free(ann.links0);
+  free(ann.links_upper);
+  free(ann_locks);
+  ann_locks = NULL;
+  free(pt);
+}
+
+// Maps the index file built over the rows x layer1_size vectors vecs
+void LoadAnnIndex(real *vecs, long long rows) {
+  struct stat st;
+  int fd = open(ann_file, O_RDONLY);
+  char *p;
+  if (fd == -1 || fstat(fd, &st) == -1 || read(fd, &ann.header, sizeof(ann.header)) != sizeof(ann.header) ||
+      memcmp(ann.header.magic, ANN_MAGIC, sizeof(ann.header.magic))) {
+    printf("ERROR: %s is not an index file\n", ann_file);
+    exit(1);
+  }
+  if (ann.header.rows != rows || ann.header.dim != layer1_size) {
+    printf("ERROR: index %s was built for other vectors (%lld x %lld)\n", ann_file, ann.header.rows, ann.header.dim);
+    exit(1);
+  }
+  ann.map_size = st.st_size;
+  if (ann.map_size != (long long) sizeof(ann.header) + rows * (long long) (sizeof(long long) + sizeof(int)) +
+                      (rows * (1 + 2 * ann.header.m) + ann.header.upper_size) * (long long) sizeof(int)) {
+    printf("ERROR: index %s is truncated\n", ann_file);
+    exit(1);
+  }
+  ann.map = mmap(NULL, ann.map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ann.map == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", ann_file);
+    exit(1);
+  }
+  ann.vecs = vecs;
+  p = (char *) ann.map + sizeof(ann.header);
+  ann.upper_offsets = (long long *) p;
+  ann.levels = (int *) (p += rows * sizeof(long long));
+  ann.links0 = (int *) (p += rows * sizeof(int));
+  ann.links_upper = (int *) (p + rows * (1 + 2 * ann.header.m) * sizeof(int));
+}
+
+// Answers the queries id, id + num_threads, ... of the block from the index, searching with a beam of ann_ef
+void *AnnQueryThread(void *id) {
+  long long a, b, q, ep;
+  int level, ef = ann_ef > top_k + 1 ? ann_ef : top_k + 1;
+  real ep_sim, *vec;
+  struct ann_search search;
+  struct query_hit *hits;
+  InitAnnSearch(&search);
+  for (q = (long long) id; q < query_num; q += num_threads) {
+    hits = query_hits + q * top_k;
+    // slots the search does not fill sort last, as in QueryThread
+    for (a = 0; a < top_k; a++) {
+      hits[a].id = -1;
+      hits[a].score = -2;
+    }
+    if (query_rows[q] < 0) continue;
+    vec = query_vecs + q * layer1_size;
+    ep = ann.header.entry;
+    ep_sim = Dot(vec, ann.vecs + ep * layer1_size, layer1_size);
+    for (level = ann.header.max_level; level > 0; level--) ep = AnnGreedy(vec, ep, &ep_sim, level);
+    AnnSearchLayer(&search, vec, ep, ep_sim, ef, 0);
+    qsort(search.res, search.num_res, sizeof(struct query_hit), HitCompare);
+    for (a = b = 0; a < search.num_res && b < top_k; a++) {
+      if (query_src == query_dst && search.res[a].id == query_rows[q]) continue;
+      hits[b++] = search.res[a];
+    }
+  }
+  FreeAnnSearch(&search);
+  pthread_exit(NULL);
+}
+
+// Merges the parts per-thread heaps of query q into merged, best first, and returns the number of hits
+int MergeHits(long long q, int parts, struct query_hit *merged) {
+  int a;
+  for (a = 0; a < parts; a++)
+    memcpy(merged + a * top_k, query_hits + (a * query_num + q) * top_k, top_k * sizeof(struct query_hit));
+  qsort(merged, parts * top_k, sizeof(struct query_hit), HitCompare);
+  for (a = 0; a < top_k && merged[a].id >= 0; a++);
+  return a;
+}
+
+// Answers the top-k queries of query_file (or stdin for "-"), one query word or document index per token, by
+// exact maximum inner product search over the unit-norm vectors. Each result line holds the query followed by
+// up to top_k "neighbour similarity" pairs, best first.
+void RunQueries() {
+  long long a, b, q;
+  char token[MAX_STRING];
+  int done = 0, parts, n;
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  struct query_hit *merged = (struct query_hit *) malloc(num_threads * top_k * sizeof(struct query_hit));
+  char (*names)[MAX_STRING] = (char (*)[MAX_STRING]) malloc(QUERY_BLOCK * sizeof(*names));
+  char word_file[MAX_STRING + 8];
+  FILE *fin, *fo;
+  // binary files take precedence over text ones
+  sprintf(word_file, "%s_w.bin", load_emb_file);
+  if (access(word_file, R_OK) == -1) sprintf(word_file, "%s_w.txt", load_emb_file);
+  vocab_size = 0;
+  if (query_type != 2) query_src = ReadEmbMatrix(word_file, &query_src_rows, 1);
+  if (query_type != 0) {
+    a = layer1_size;
+    query_dst = ReadEmbMatrix(load_doc_file, &query_dst_rows, 0);
+    if (query_type == 1 && layer1_size != a) {
+      printf("ERROR: word and document vectors have different dimensions!\n");
+      exit(1);
+    }
+  }
+  if (query_type == 0) {
+    query_dst = query_src;
+    query_dst_rows = query_src_rows;
+  } else if (query_type == 2) {
+    query_src = query_dst;
+    query_src_rows = query_dst_rows;
+  }
+  if (ann_file[0] != 0) LoadAnnIndex(query_dst, query_dst_rows);
+  fin = strcmp(query_file, "-") ? fopen(query_file, "rb") : stdin;
+  fo = query_output[0] != 0 ? fopen(query_output, "wb") : stdout;
+  if (fin == NULL || fo == NULL) {
+    printf("ERROR: cannot open the query input or output file!\n");
+    exit(1);
+  }
+  query_rows = (long long *) malloc(QUERY_BLOCK * sizeof(long long));
+  query_vecs = (real *) malloc(QUERY_BLOCK * layer1_size * sizeof(real));
+  query_hits = (struct query_hit *) malloc(num_threads * QUERY_BLOCK * top_k * sizeof(struct query_hit));
+  while (!done) {
+    // read the next block of queries and gather their vectors
+    for (query_num = 0; query_num < QUERY_BLOCK;) {
+      ReadWord(token, fin);
+      if (feof(fin) && token[0] == 0) {
+        done = 1;
+        break;
+      }
+      if (!strcmp(token, "</s>")) continue;
+      strcpy(names[query_num], token);
+      if (query_type == 2) {
+        q = atoll(token);
+        if (q < 0 || q >= query_src_rows) q = -1;
+      } else q = SearchVocab(token);
+      query_rows[query_num] = q;
+      if (q >= 0) memcpy(query_vecs + query_num * layer1_size, query_src + q * layer1_size, layer1_size * sizeof(real));
+      query_num++;
+    }
+    if (query_num == 0) break;
+    for (a = 0; a < num_threads; a++)
+      pthread_create(&pt[a], NULL, ann.map != NULL ? AnnQueryThread : QueryThread, (void *) a);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    // merge the per-thread heaps of every query; the index search leaves a single sorted list per query
+    parts = ann.map != NULL ? 1 : num_threads;
+    for (q = 0; q < query_num; q++) {
+      fprintf(fo, "%s", names[q]);
+      if (query_rows[q] >= 0) {
+        n = MergeHits(q, parts, merged);
+        for (b = 0; b < n; b++) {
+          if (query_type == 0) fprintf(fo, " %s %f", vocab[merged[b].id].word, merged[b].score);
+          else fprintf(fo, " %lld %f", merged[b].id, merged[b].score);
+        }
+      }
+      fprintf(fo, "\n");
+    }
+  }
+  if (fin != stdin) fclose(fin);
+  if (fo != stdout) fclose(fo);
+  if (ann.map != NULL) munmap(ann.map, ann.map_size);
+  free(pt);
+  free(merged);
+  free(names);
+  free(query_rows);
+  free(query_vecs);
+  free(query_hits);
+}
+
+// Writes a checkpoint of the running training to checkpoint_file. The matrices are written while the training
+// threads keep updating them, so a checkpoint is a slightly blurred snapshot, as any Hogwild state is; the file is
+// replaced atomically, so an interrupted write leaves the previous checkpoint intact.
+void WriteCheckpoint() {
+  long long a, size;
+  struct ckpt_header header;
+  struct thread_state *states = (struct thread_state *) malloc(num_threads * sizeof(struct thread_state));
+  long long *nexts = (long long *) malloc(num_threads * sizeof(long long));
+  long long *seqs = (long long *) malloc(num_threads * sizeof(long long));
+  char tmp_file[MAX_STRING + 8], pad[EMB_ALIGN];
+  FILE *fo;
+  // copy the thread states and queue positions while no thread is between claiming a chunk and publishing the state
+  // that points into it, retrying if one was
+  while (1) {
+    for (a = 0; a < num_threads; a++) if ((seqs[a] = *(volatile long long *) &state_seqs[a].seq) & 1) break;
+    if (a < num_threads) {
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(states, thread_states, num_threads * sizeof(struct thread_state));
+    for (a = 0; a < num_threads; a++) nexts[a] = chunk_queues[a].next;
+    __sync_synchronize();
+    for (a = 0; a < num_threads; a++) if (*(volatile long long *) &state_seqs[a].seq != seqs[a]) break;
+    if (a == num_threads) break;
+  }
+  memset(&header, 0, sizeof(header));
+  memset(pad, 0, sizeof(pad));
+  memcpy(header.magic, CKPT_MAGIC, sizeof(header.magic));
+  header.vocab_size = vocab_size;
+  header.corpus_size = corpus_size;
+  header.dim = layer1_size;
+  header.num_threads = num_threads;
+  header.cached = cache_tokens != NULL;
+  header.iter = iter;
+  header.num_chunks = num_chunks;
+  header.train_words = train_words;
+  header.word_count_actual = word_count_actual;
+  header.doc_precision = doc_precision;
+  TrainFileStamp(&header.train_size, &header.train_mtime);
+  header.alpha = alpha;
+  header.starting_alpha = starting_alpha;
+  for (a = 0; a < vocab_size; a++) header.names_size += strlen(vocab[a].word) + 1;
+  size = sizeof(header) + vocab_size * sizeof(long long) + header.names_size;
+  size = (size + 7) / 8 * 8 + num_threads * (sizeof(struct thread_state) + sizeof(long long)) +
+         2 * (num_chunks + 1) * sizeof(long long);
+  header.data_offset = (size + EMB_ALIGN - 1) / EMB_ALIGN * EMB_ALIGN;
+  sprintf(tmp_file, "%s.tmp", checkpoint_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write checkpoint %s\n", tmp_file);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  for (a = 0; a < vocab_size; a++) fwrite(&vocab[a].cn, sizeof(long long), 1, fo);
+  for (a = 0; a < vocab_size; a++) fwrite(vocab[a].word, 1, strlen(vocab[a].word) + 1, fo);
+  size = sizeof(header) + vocab_size * sizeof(long long) + header.names_size;
+  fwrite(pad, 1, (size + 7) / 8 * 8 - size, fo);
+  fwrite(states, sizeof(struct thread_state), num_threads, fo);
+  fwrite(nexts, sizeof(long long), num_threads, fo);
+  fwrite(chunk_starts, sizeof(long long), num_chunks + 1, fo);
+  fwrite(chunk_docs, sizeof(long long), num_chunks + 1, fo);
+  fwrite(pad, 1, header.data_offset - ftell(fo), fo);
+  fwrite(syn0, sizeof(real), vocab_size * layer1_size, fo);
+  fwrite(syn1neg, sizeof(real), vocab_size * layer1_size, fo);
+  if (doc_precision) fwrite(syn1doc16, DocRowBytes(), corpus_size, fo);
+  else fwrite(syn1doc, DocRowBytes(), corpus_size, fo);
+  if (ferror(fo) || fclose(fo) != 0 || rename(tmp_file, checkpoint_file) != 0) {
+    printf("ERROR: failed to write checkpoint %s\n", checkpoint_file);
+    exit(1);
+  }
+  free(states);
+  free(nexts);
+  free(seqs);
+}
+
+// Writes a checkpoint every checkpoint_interval seconds until the training threads are done
+void *CheckpointThread(void *arg) {
+  struct timespec until;
+  pthread_mutex_lock(&done_lock);
+  while (!training_done) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += checkpoint_interval;
+    if (pthread_cond_timedwait(&done_cond, &done_lock, &until) != ETIMEDOUT || training_done) continue;
+    pthread_mutex_unlock(&done_lock);
+    WriteCheckpoint();
+    if (debug_mode > 1) printf("\nCheckpoint written to %s\n", checkpoint_file);
+    pthread_mutex_lock(&done_lock);
+  }
+  pthread_mutex_unlock(&done_lock);
+  pthread_exit(NULL);
+}
+
+// Restores the vocabulary, chunks, work queues, thread states and progress of checkpoint_file and maps its matrices
+// copy-on-write, so that resuming costs no more than the pages training touches
+void ReadCheckpoint() {
+  long long a, size, train_size, train_mtime;
+  struct ckpt_header header;
+  struct stat st;
+  char *map, *p;
+  int fd = open(checkpoint_file, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, CKPT_MAGIC, sizeof(header.magic))) {
+    printf("ERROR: %s is not a checkpoint\n", checkpoint_file);
+    exit(1);
+  }
+  if (header.dim != layer1_size || header.num_threads != num_threads || header.iter != iter ||
+      header.cached != (cache_file[0] != 0) || header.doc_precision != doc_precision) {
+    printf("ERROR: the checkpoint was taken with -size %lld, -threads %lld, -iter %lld, -doc-precision %lld and%s "
+           "-cache\n", header.dim, header.num_threads, header.iter, header.doc_precision, header.cached ? "" : " no");
+    exit(1);
+  }
+  if (!TrainFileStamp(&train_size, &train_mtime)) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  // the chunks are file offsets (or cache tokens) into the training file as it was
+  if (train_size != header.train_size || train_mtime != header.train_mtime) {
+    printf("ERROR: %s changed since the checkpoint was taken (size %lld, now %lld, or modification time)\n",
+           train_file, header.train_size, train_size);
+    exit(1);
+  }
+  if (st.st_size != header.data_offset + 2 * header.vocab_size * header.dim * (long long) sizeof(real) +
+                    header.corpus_size * DocRowBytes()) {
+    printf("ERROR: checkpoint %s is truncated\n", checkpoint_file);
+    exit(1);
+  }
+  map = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", checkpoint_file);
+    exit(1);
+  }
+  p = map + sizeof(header) + header.vocab_size * sizeof(long long);
+  vocab_size = 0;
+  for (a = 0; a < header.vocab_size; a++, p += strlen(p) + 1) {
+    AddWordToVocab(p);
+    vocab[a].cn = ((long long *) (map + sizeof(header)))[a];
+    corpus_words += vocab[a].cn;
+  }
+  size = p - map;
+  p = map + (size + 7) / 8 * 8;
+  memcpy(thread_states, p, num_threads * sizeof(struct thread_state));
+  p += num_threads * sizeof(struct thread_state);
+  corpus_size = header.corpus_size;
+  num_chunks = chunks_max = header.num_chunks;
+  chunk_starts = (long long *) malloc((num_chunks + 1) * sizeof(long long));
+  chunk_docs = (long long *) malloc((num_chunks + 1) * sizeof(long long));
+  InitChunkQueues();
+  for (a = 0; a < num_threads; a++, p += sizeof(long long)) memcpy(&chunk_queues[a].next, p, sizeof(long long));
+  memcpy(chunk_starts, p, (num_chunks + 1) * sizeof(long long));
+  memcpy(chunk_docs, p + (num_chunks + 1) * sizeof(long long), (num_chunks + 1) * sizeof(long long));
+  syn0 = (real *) (map + header.data_offset);
+  syn1neg = syn0 + vocab_size * layer1_size;
+  if (doc_precision) syn1doc16 = (unsigned short *) (syn1neg + vocab_size * layer1_size);
+  else syn1doc = syn1neg + vocab_size * layer1_size;
+  if (doc_mmap) {
+    // the checkpointed document vectors become the initial contents of the mapped output file
+    p = (char *) syn1doc;
+    MapDocFile();
+    memcpy(syn1doc, p, corpus_size * layer1_size * sizeof(real));
+  }
+  train_words = header.train_words;
+  word_count_actual = start_word_count = header.word_count_actual;
+  alpha = header.alpha;
+  starting_alpha = header.starting_alpha;
+  fd = open(train_file, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  close(fd);
+  file_size = st.st_size;
+  if (debug_mode > 0)
+    printf("Resuming from %s: vocab size %lld, %.2f%% done\n", checkpoint_file, vocab_size,
+           word_count_actual / (real) (iter * train_words + 1) * 100);
+}
+
+// Reads the document vectors of the old model and, from -doc-ids, the old index of every training document
+void LoadOldDocs() {
+  long long a, dim = layer1_size;
+  FILE *fin;
+  old_docs = ReadEmbMatrix(load_doc_file, &old_doc_rows, 0);
+  if (layer1_size != dim) {
+    printf("ERROR: the vectors of %s have %lld dimensions, not -size %lld\n", load_doc_file, layer1_size, dim);
+    exit(1);
+  }
+  doc_ids = (long long *) malloc(corpus_size * sizeof(long long));
+  for (a = 0; a < corpus_size; a++) doc_ids[a] = -1;
+  if (doc_ids_file[0] == 0) return;
+  fin = fopen(doc_ids_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: document id file not found!\n");
+    exit(1);
+  }
+  for (a = 0; a < corpus_size; a++)
+    if (fscanf(fin, "%lld", &doc_ids[a]) != 1 || doc_ids[a] < -1 || doc_ids[a] >= old_doc_rows) {
+      printf("ERROR: %s needs an index below %lld, or -1, for each of the %lld documents of %s\n", doc_ids_file,
+             old_doc_rows, corpus_size, train_file);
+      exit(1);
+    }
+  fclose(fin);
+}
+
+// Orders changed documents by old index, a document changed twice by its position in the training file
+int DocIdCompare(const void *a, const void *b) {
+  long long x = *(long long *) a, y = *(long long *) b;
+  if (doc_ids[x] != doc_ids[y]) return doc_ids[x] < doc_ids[y] ? -1 : 1;
+  return (x > y) - (x < y);
+}
+
+// Writes the old document vectors into -doc-output, each changed document in place of its old row (the last
+// version if it was changed twice), followed by the new documents in training file order
+void SaveIncrementalDocs() {
+  long long a, k = 0, num_changed = 0, rows = old_doc_rows;
+  long long *changed = (long long *) malloc(corpus_size * sizeof(long long));
+  real *row = (real *) malloc(layer1_size * sizeof(real));
+  FILE *fo;
+  for (a = 0; a < corpus_size; a++) if (doc_ids[a] >= 0) changed[num_changed++] = a;
+  qsort(changed, num_changed, sizeof(long long), DocIdCompare);
+  fo = StartEmbFile(doc_output, -1, 0);
+  for (a = 0; a < old_doc_rows; a++) {
+    if (k < num_changed && doc_ids[changed[k]] == a) {
+      while (k + 1 < num_changed && doc_ids[changed[k + 1]] == a) k++;
+      WriteEmbRows(fo, DocRow(changed[k++], row, 1), a, 1, 0);
+    } else WriteEmbRows(fo, old_docs + a * layer1_size, a, 1, 0);
+  }
+  for (a = 0; a < corpus_size; a++) if (doc_ids[a] < 0) WriteEmbRows(fo, DocRow(a, row, 1), rows++, 1, 0);
+  FinishEmbFile(fo, doc_output, rows);
+  if (debug_mode > 0) printf("Documents: %lld old, %lld changed, %lld new\n", old_doc_rows, num_changed, rows - old_doc_rows);
+  free(changed);
+  free(row);
+}
+
+void TrainModel() {
+  long a;
+  long long rows;
+  real *vecs;
+  FILE *fo;
+  int evaluate = num_eval_sim > 0 || eval_labels[0] != 0 || early_stop > 0;
+  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t)), checkpoint_thread, stats_thread;
+  pthread_t sync_thread, server_thread;
+  printf("Starting training using file %s\n", train_file);
+  if (debug_mode > 0) printf("Row kernels: %s\n", kernels->name);
+
+  starting_alpha = alpha;
+  if (numa) InitNumaTopology();
+  if (checkpoint_file[0] != 0) {
+    thread_states = (struct thread_state *) calloc(num_threads, sizeof(struct thread_state));
+    state_seqs = (struct state_seq *) calloc(num_threads, sizeof(struct state_seq));
+  }
+  if (resume) ReadCheckpoint();
+  else if (incremental) MergeVocab();
+  else if (read_vocab_file[0] != 0) ReadVocab();
+  else if (vocab_size == 0) LearnVocabFromTrainFile();
+  // a vocabulary read from a file, or built before by jose_build_vocab, still needs the chunks of the training file
+  if (!resume && !infer && num_chunks == 0 && cache_file[0] == 0) ChunkTrainFile();
+  if (save_vocab_file[0] != 0) SaveVocab(save_vocab_file);
+  if (hot_rows > vocab_size) hot_rows = vocab_size;
+  if (workers > 1) CountTrainWords();
+  if (incremental) LoadOldDocs();
+  if (infer) {
+    // syn1doc only holds the block of documents being inferred
+    corpus_size = infer_block;
+    InitNet();
+    InitUnigramTable();
+    InferDocs();
+    free(pt);
+    return;
+  }
+  if (cache_file[0] != 0) LoadCorpusCache();
+  if (!resume) {
+    if (cache_file[0] != 0) ChunkCorpusCache();
+    if (num_chunks < 2 * num_threads) SplitSmallChunks();
+    InitChunkQueues();
+    InitNet();
+  }
+  InitUnigramTable();
+  if (debug_mode > 0) printf("Chunks: %lld\n", num_chunks);
+  epoch_obj = (double *) calloc(2 * iter, sizeof(double));
+  epoch_steps = (long long *) calloc(iter, sizeof(long long));
+  if (num_eval_sim > 0) LoadSimSets();
+  if (eval_labels[0] != 0) LoadEvalLabels();
+  // the first evaluation is due at the end of the epoch training starts (or resumes) in
+  rows = word_count_actual / train_words + 1;
+  if (evaluate && rows < iter) eval_next = rows * train_words;
+  if (workers > 1) StartSync(&server_thread);
+  train_start = WallTime();
+  
+  if (workers > 1) pthread_create(&sync_thread, NULL, SyncThread, NULL);
+  if (checkpoint_file[0] != 0) pthread_create(&checkpoint_thread, NULL, CheckpointThread, NULL);
+  if (stats_file[0] != 0) pthread_create(&stats_thread, NULL, StatsThread, NULL);
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *) a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  pthread_mutex_lock(&done_lock);
+  training_done = 1;
+  pthread_cond_broadcast(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+  if (checkpoint_file[0] != 0) pthread_join(checkpoint_thread, NULL);
+  if (stats_file[0] != 0) pthread_join(stats_thread, NULL);
+  if (workers > 1) pthread_join(sync_thread, NULL);
+  CheckThreads();
+  if (evaluate && !stop_training) EvaluateEpoch(iter - 1);
+  if (debug_mode > 0) {
+    ReportLoadBalance();
+    ReportEpochs();
+  }
+  if (workers > 1 && rank == 0) {
+    pthread_join(server_thread, NULL);
+    if (debug_mode > 0) ReportWorkers();
+  }
+
+  if (word_emb[0] != 0) SaveEmb(word_emb, syn0, vocab_size, 1);
+  if (context_emb[0] != 0) SaveEmb(context_emb, syn1neg, vocab_size, 1);
+  if (incremental) SaveIncrementalDocs();
+  else if (doc_output[0] != 0 && !doc_mmap) {
+    fo = StartEmbFile(doc_output, corpus_size, 0);
+    WriteDocRows(fo, 0, corpus_size);
+    FinishEmbFile(fo, doc_output, -1);
+  }
+  if (ann_file[0] != 0 && incremental) {
+    // the graph covers all documents of the merged output
+    vecs = ReadEmbMatrix(doc_output, &rows, 0);
+    BuildAnnIndex(vecs, rows);
+  } else if (ann_file[0] != 0) {
+    // the graph needs float vectors: with half precision, those just saved (mapped when binary) or a converted copy
+    if (!doc_precision) vecs = syn1doc;
+    else if (binary && doc_output[0] != 0) vecs = ReadEmbMatrix(doc_output, &rows, 0);
+    else {
+      vecs = (real *) malloc(corpus_size * layer1_size * sizeof(real));
+      for (rows = 0; rows < corpus_size; rows++) DocRow(rows, vecs + rows * layer1_size, 1);
+    }
+    BuildAnnIndex(vecs, corpus_size);
+  }
+  if (doc_mmap) UnmapDocFile();
+  FreeEvalData();
+}
+
+// options found by ArgPos, and whether they are only counted instead of set, for jose_set
+__thread int args_matched = 0, args_dry_run = 0;
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++)
+    if (!strcmp(str, argv[a])) {
+      if (a == argc - 1) {
+        printf("Argument missing for %s\n", str);
+        exit(1);
+      }
+      args_matched++;
+      return args_dry_run ? -1 : a;
+    }
+  return -1;
+}
+
+// Sets the options given in argv, as on the command line
+void ParseArgs(int argc, char **argv) {
+  int i;
+  if ((i = ArgPos((char *) "-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-load-emb", argc, argv)) > 0) strcpy(load_emb_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-cache", argc, argv)) > 0) strcpy(cache_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-infer", argc, argv)) > 0) infer = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-infer-block", argc, argv)) > 0) infer_block = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-query", argc, argv)) > 0) strcpy(query_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-query-type", argc, argv)) > 0) query_type = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-top-k", argc, argv)) > 0) top_k = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-query-output", argc, argv)) > 0) strcpy(query_output, argv[i + 1]);
+  if ((i = ArgPos((char *) "-load-doc", argc, argv)) > 0) strcpy(load_doc_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-ann-index", argc, argv)) > 0) strcpy(ann_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-ann-m", argc, argv)) > 0) ann_m = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-ann-ef-construction", argc, argv)) > 0) ann_ef_construction = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-ann-ef", argc, argv)) > 0) ann_ef = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-resume", argc, argv)) > 0) resume = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-chunk-words", argc, argv)) > 0) chunk_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-doc-precision", argc, argv)) > 0) doc_precision = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-doc-mmap", argc, argv)) > 0) doc_mmap = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-incremental", argc, argv)) > 0) incremental = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-doc-ids", argc, argv)) > 0) strcpy(doc_ids_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-workers", argc, argv)) > 0) workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-rank", argc, argv)) > 0) rank = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-sync-server", argc, argv)) > 0) strcpy(sync_server, argv[i + 1]);
+  if ((i = ArgPos((char *) "-sync-interval", argc, argv)) > 0) sync_interval = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-stats-file", argc, argv)) > 0) strcpy(stats_file, argv[i + 1]);
+  if ((i = ArgPos((char *) "-stats-interval", argc, argv)) > 0) stats_interval = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-numa", argc, argv)) > 0) numa = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-word-output", argc, argv)) > 0) strcpy(word_emb, argv[i + 1]);
+  if ((i = ArgPos((char *) "-context-output", argc, argv)) > 0) strcpy(context_emb, argv[i + 1]);
+  if ((i = ArgPos((char *) "-doc-output", argc, argv)) > 0) strcpy(doc_output, argv[i + 1]);
+  if ((i = ArgPos((char *) "-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-sampler", argc, argv)) > 0) sampler = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-hot-rows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-kernels", argc, argv)) > 0) strcpy(kernel_name, argv[i + 1]);
+  if ((i = ArgPos((char *) "-prefetch", argc, argv)) > 0) prefetch = atoi(argv[i + 1]);
+  // -eval-sim is given once per dataset
+  if ((i = ArgPos((char *) "-eval-sim", argc, argv)) > 0)
+    for (; i < argc - 1; i++)
+      if (!strcmp(argv[i], "-eval-sim") && num_eval_sim++ < MAX_EVAL_SIM)
+        strcpy(eval_sim[num_eval_sim - 1], argv[i + 1]);
+  if ((i = ArgPos((char *) "-eval-labels", argc, argv)) > 0) strcpy(eval_labels, argv[i + 1]);
+  if ((i = ArgPos((char *) "-eval-docs", argc, argv)) > 0) eval_docs = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *) "-eval-k", argc, argv)) > 0) eval_k = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-early-stop", argc, argv)) > 0) early_stop = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-early-stop-delta", argc, argv)) > 0) early_stop_delta = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-margin", argc, argv)) > 0) margin = atof(argv[i + 1]);
+  if ((i = ArgPos((char *) "-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *) "-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+}
+
+// Checks the options for consistency before anything is trained, inferred or queried
+void CheckArgs() {
+  if (negative <= 0) {
+    printf("ERROR: Nubmer of negative samples must be positive!\n");
+    exit(1);
+  }
+  if (infer && (read_vocab_file[0] == 0 || load_emb_file[0] == 0 || doc_output[0] == 0 || infer_block <= 0)) {
+    printf("ERROR: -infer needs -read-vocab, -load-emb and -doc-output of the trained model!\n");
+    exit(1);
+  }
+  if (resume && (checkpoint_file[0] == 0 || infer)) {
+    printf("ERROR: -resume needs the -checkpoint to continue from!\n");
+    exit(1);
+  }
+  if (hot_rows < 0) {
+    printf("ERROR: -hot-rows must not be negative!\n");
+    exit(1);
+  }
+  if (prefetch < 0 || prefetch == 1) {
+    printf("ERROR: -prefetch must be 0 (off) or at least 2 blocks!\n");
+    exit(1);
+  }
+  // the reader threads claim chunks ahead of training, and a checkpoint would count the buffered ones as done
+  if (prefetch && checkpoint_file[0] != 0) {
+    printf("ERROR: -prefetch cannot be used with -checkpoint or -resume!\n");
+    exit(1);
+  }
+  if (num_eval_sim > MAX_EVAL_SIM) {
+    printf("ERROR: at most %d -eval-sim datasets!\n", MAX_EVAL_SIM);
+    exit(1);
+  }
+  if ((num_eval_sim > 0 || eval_labels[0] != 0 || early_stop != 0) && (infer || workers > 1)) {
+    printf("ERROR: -eval-sim, -eval-labels and -early-stop evaluate training and cannot be used with -infer or "
+           "-workers!\n");
+    exit(1);
+  }
+  if (eval_docs <= 0 || eval_k < 0 || early_stop < 0 || early_stop_delta < 0) {
+    printf("ERROR: -eval-docs must be positive and -eval-k, -early-stop, -early-stop-delta not negative!\n");
+    exit(1);
+  }
+  if (doc_precision < 0 || doc_precision > 2) {
+    printf("ERROR: -doc-precision must be 0, 1 or 2!\n");
+    exit(1);
+  }
+  if (doc_mmap && (doc_output[0] == 0 || !binary || doc_precision || infer)) {
+    printf("ERROR: -doc-mmap trains into a binary (-binary 1) float32 -doc-output and cannot be used with -infer!\n");
+    exit(1);
+  }
+  if (incremental && (read_vocab_file[0] == 0 || load_emb_file[0] == 0 || load_doc_file[0] == 0 ||
+                      doc_output[0] == 0 || !strcmp(load_doc_file, doc_output) || infer || doc_mmap)) {
+    printf("ERROR: -incremental needs -read-vocab, -load-emb and -load-doc of the old model and a new -doc-output,\n"
+           "and cannot be used with -infer or -doc-mmap!\n");
+    exit(1);
+  }
+  if (workers > 1 && (sync_server[0] == 0 || read_vocab_file[0] == 0 || rank < 0 || rank >= workers ||
+                      sync_interval <= 0 || infer || incremental || checkpoint_file[0] != 0)) {
+    printf("ERROR: -workers needs -sync-server, a -rank below -workers, a positive -sync-interval and the -read-vocab\n"
+           "of the whole corpus, and cannot be used with -infer, -incremental or -checkpoint!\n");
+    exit(1);
+  }
+  if (chunk_words <= 0) {
+    printf("ERROR: -chunk-words must be positive!\n");
+    exit(1);
+  }
+  if (stats_interval <= 0) {
+    printf("ERROR: -stats-interval must be positive!\n");
     exit(1);
   }
-  if (syn1doc == NULL) {
-    printf("Memory allocation failed (syn1doc)\n");
+  if (checkpoint_interval <= 0) {
+    printf("ERROR: -checkpoint-interval must be positive!\n");
     exit(1);
   }
-  
-  real norm;
-  if (load_emb_file[0] != 0) {
-    char *center_emb_file = (char *) calloc(MAX_STRING, sizeof(char));
-    char *context_emb_file = (char *) calloc(MAX_STRING, sizeof(char));
-    strcpy(center_emb_file, load_emb_file);
-    strcat(center_emb_file, "_w.txt");
-    strcpy(context_emb_file, load_emb_file);
-    strcat(context_emb_file, "_v.txt");
-    LoadEmb(center_emb_file, syn0);
-    LoadEmb(context_emb_file, syn1neg);
+  if (ann_m < 2 || ann_ef_construction <= 0 || ann_ef <= 0) {
+    printf("ERROR: -ann-m must be at least 2 and -ann-ef, -ann-ef-construction positive!\n");
+    exit(1);
   }
-  else {
-    for (a = 0; a < vocab_size; a++) {
-      norm = 0.0;
-      for (b = 0; b < layer1_size; b++) {
-        next_random = next_random * (unsigned long long) 25214903917 + 11;
-        syn1neg[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
-        norm += syn1neg[a * layer1_size + b] * syn1neg[a * layer1_size + b];
-      }
-      for (b = 0; b < layer1_size; b++)
-        syn1neg[a * layer1_size + b] /= sqrt(norm);
-    }
-    for (a = 0; a < vocab_size; a++) {
-      norm = 0.0;
-      for (b = 0; b < layer1_size; b++) {
-        next_random = next_random * (unsigned long long) 25214903917 + 11;
-        syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
-        norm += syn0[a * layer1_size + b] * syn0[a * layer1_size + b];
-      }
-      for (b = 0; b < layer1_size; b++)
-        syn0[a * layer1_size + b] /= sqrt(norm);
-    }
+#ifdef JOSE_LIBRARY
+  // the sync threads wait on the other workers, so an error of one of them could not end the call
+  if (workers > 1) {
+    printf("ERROR: -workers is only available in the jose command!\n");
+    exit(1);
   }
+#endif
+}
 
-  for (a = 0; a < corpus_size; a++) {
-    norm = 0.0;
-    for (b = 0; b < layer1_size; b++) {
-      next_random = next_random * (unsigned long long) 25214903917 + 11;
-      syn1doc[a * layer1_size + b] = (((next_random & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
-      norm += syn1doc[a * layer1_size + b] * syn1doc[a * layer1_size + b];
-    }
-    for (b = 0; b < layer1_size; b++)
-      syn1doc[a * layer1_size + b] /= sqrt(norm);
-  }
+// Library interface (jose.h). The engine keeps the state of one model in the globals above; a jose_model holds its
+// own copy of all of them. Calls that run the engine swap that copy in under model_lock and back out when they
+// return; calls that only read a model (queries, words, vectors) read its copy under the model's own lock.
+struct jose_model {
+  char *state;
+  pthread_mutex_t lock; // held by every call on the model
+  int broken;           // set while a call changes the model, and left set if that call fails
+  char **options;       // option, value pairs of jose_set, not yet set in the state
+  int num_options;
+};
+
+struct model_var {
+  void *addr;
+  size_t size;
+};
+
+// every global of the engine; make libjose.so fails if one is neither here nor in SHARED_VARS of the makefile
+#define MODEL_VAR(x) {(void *) &(x), sizeof(x)}
+struct model_var model_vars[] = {
+  MODEL_VAR(train_file), MODEL_VAR(load_emb_file), MODEL_VAR(word_emb), MODEL_VAR(context_emb),
+  MODEL_VAR(doc_output), MODEL_VAR(save_vocab_file), MODEL_VAR(read_vocab_file), MODEL_VAR(cache_file),
+  MODEL_VAR(query_file), MODEL_VAR(query_output), MODEL_VAR(load_doc_file), MODEL_VAR(ann_file),
+  MODEL_VAR(checkpoint_file), MODEL_VAR(vocab), MODEL_VAR(vocab_arena), MODEL_VAR(debug_mode), MODEL_VAR(window),
+  MODEL_VAR(min_count), MODEL_VAR(num_threads), MODEL_VAR(min_reduce), MODEL_VAR(vocab_hash),
+  MODEL_VAR(vocab_hash_size), MODEL_VAR(num_chunks), MODEL_VAR(chunks_max), MODEL_VAR(chunk_words),
+  MODEL_VAR(chunk_starts), MODEL_VAR(chunk_docs), MODEL_VAR(chunk_queues), MODEL_VAR(numa), MODEL_VAR(num_nodes),
+  MODEL_VAR(thread_cpus), MODEL_VAR(thread_nodes), MODEL_VAR(thread_ranks), MODEL_VAR(node_threads),
+  MODEL_VAR(thread_stats), MODEL_VAR(vocab_max_size), MODEL_VAR(vocab_size), MODEL_VAR(corpus_size),
+  MODEL_VAR(layer1_size), MODEL_VAR(train_words), MODEL_VAR(word_count_actual), MODEL_VAR(start_word_count),
+  MODEL_VAR(iter), MODEL_VAR(file_size), MODEL_VAR(corpus_words), MODEL_VAR(negative), MODEL_VAR(batch),
+  MODEL_VAR(hot_rows), MODEL_VAR(prefetch), MODEL_VAR(eval_sim), MODEL_VAR(eval_labels), MODEL_VAR(num_eval_sim),
+  MODEL_VAR(eval_k), MODEL_VAR(early_stop), MODEL_VAR(eval_pending), MODEL_VAR(stop_training), MODEL_VAR(eval_bad),
+  MODEL_VAR(eval_docs), MODEL_VAR(eval_next), MODEL_VAR(eval_parked), MODEL_VAR(eval_finished),
+  MODEL_VAR(eval_best_epoch), MODEL_VAR(early_stop_delta), MODEL_VAR(eval_best), MODEL_VAR(sim_sets),
+  MODEL_VAR(eval_doc_ids), MODEL_VAR(eval_num_docs), MODEL_VAR(eval_doc_labels), MODEL_VAR(eval_num_labels),
+  MODEL_VAR(eval_assign), MODEL_VAR(eval_vecs), MODEL_VAR(eval_centroids), MODEL_VAR(eval_changed),
+  MODEL_VAR(epoch_obj), MODEL_VAR(epoch_steps), MODEL_VAR(binary), MODEL_VAR(infer), MODEL_VAR(sampler),
+  MODEL_VAR(word_table), MODEL_VAR(alias_table),
+  MODEL_VAR(alpha), MODEL_VAR(starting_alpha), MODEL_VAR(sample), MODEL_VAR(margin), MODEL_VAR(syn0),
+  MODEL_VAR(syn1neg), MODEL_VAR(syn1doc), MODEL_VAR(doc_precision), MODEL_VAR(syn1doc16), MODEL_VAR(doc_mmap),
+  MODEL_VAR(doc_map), MODEL_VAR(doc_map_size), MODEL_VAR(incremental), MODEL_VAR(doc_ids_file), MODEL_VAR(doc_ids),
+  MODEL_VAR(old_doc_rows), MODEL_VAR(old_docs), MODEL_VAR(infer_tokens), MODEL_VAR(infer_doc_starts),
+  MODEL_VAR(infer_num_docs), MODEL_VAR(infer_block), MODEL_VAR(infer_docs), MODEL_VAR(infer_rows),
+  MODEL_VAR(query_type), MODEL_VAR(top_k), MODEL_VAR(query_src), MODEL_VAR(query_dst), MODEL_VAR(query_vecs),
+  MODEL_VAR(query_src_rows), MODEL_VAR(query_dst_rows), MODEL_VAR(query_rows), MODEL_VAR(query_num),
+  MODEL_VAR(query_hits), MODEL_VAR(ann), MODEL_VAR(ann_m), MODEL_VAR(ann_ef_construction), MODEL_VAR(ann_ef),
+  MODEL_VAR(ann_locks), MODEL_VAR(ann_next), MODEL_VAR(thread_states), MODEL_VAR(state_seqs), MODEL_VAR(resume),
+  MODEL_VAR(checkpoint_interval), MODEL_VAR(stats_interval), MODEL_VAR(training_done), MODEL_VAR(stats_file),
+  MODEL_VAR(cache_tokens), MODEL_VAR(cache_doc_ends), MODEL_VAR(cache_num_tokens), MODEL_VAR(cache_map_size),
+  MODEL_VAR(cache_map), MODEL_VAR(train_start), MODEL_VAR(workers), MODEL_VAR(rank), MODEL_VAR(sync_fd),
+  MODEL_VAR(listen_fd), MODEL_VAR(workers_done), MODEL_VAR(sync_server), MODEL_VAR(sync_interval),
+  MODEL_VAR(sync_base), MODEL_VAR(sync_buf), MODEL_VAR(master), MODEL_VAR(sync_ids), MODEL_VAR(sync_epoch),
+  MODEL_VAR(master_version), MODEL_VAR(master_epoch), MODEL_VAR(master_applying), MODEL_VAR(sync_time),
+  MODEL_VAR(worker_reports), MODEL_VAR(vocab_words_read)
+};
+#define NUM_MODEL_VARS (sizeof(model_vars) / sizeof(model_vars[0]))
+
+// held while a call runs the engine on the globals, so that only one does at a time
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+char *model_defaults; // the initial values of the globals, taken before the first model changed them
+size_t model_state_size = 0;
+// the error of the last jose_* call of a thread that failed, and where JoseExit returns to during a call
+__thread char api_error[MAX_STRING * 4];
+__thread jmp_buf *api_jmp;
+__thread char last_output[MAX_STRING * 4]; // the text of the thread's last printf
+// set while a jose_* call runs the engine, and the first error of a thread that the call started
+int engine_call = 0, engine_failed = 0;
+char engine_error[MAX_STRING * 4];
+
+// printf that also keeps the text, which becomes the error message if exit follows
+int JosePrintf(const char *format, ...) {
+  va_list args, copy;
+  int n;
+  va_start(args, format);
+  va_copy(copy, args);
+  vsnprintf(last_output, sizeof(last_output), format, copy);
+  va_end(copy);
+  n = vprintf(format, args);
+  va_end(args);
+  return n;
 }
 
-void *TrainModelThread(void *id) {
-  long long a, b, d, doc = 0, word, last_word, sentence_length = 0, sentence_position = 0;
-  long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-  long long l1, l2, l3 = 0, c, target, local_iter = iter;
-  unsigned long long next_random = (long long) id;
-  real f, g, h, step, obj_w = 0, obj_d = 0;
-  clock_t now;
-  real *neu1 = (real *) calloc(layer1_size, sizeof(real));
-  real *grad = (real *) calloc(layer1_size, sizeof(real));
-  real *neu1e = (real *) calloc(layer1_size, sizeof(real));
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long) num_threads * (long long) id, SEEK_SET);
+// exit that, within a jose_* call on this thread, fails the call instead of ending the process. On a thread that
+// the call started, it keeps the first error for CheckThreads, stops training and ends only the thread.
+void JoseExit(int status) {
+  size_t n;
+  if (api_jmp == NULL && !engine_call) (exit)(status);
+  if (api_jmp == NULL) {
+    if (__sync_bool_compare_and_swap(&engine_failed, 0, 1)) strcpy(engine_error, last_output);
+    stop_training = 1;
+    pthread_exit(NULL);
+  }
+  strcpy(api_error, strncmp(last_output, "ERROR: ", 7) ? last_output : last_output + 7);
+  for (n = strlen(api_error); n > 0 && (api_error[n - 1] == '\n' || api_error[n - 1] == '!'); n--) api_error[n - 1] = 0;
+  longjmp(*api_jmp, 1);
+}
 
-  while (1) {
-    if (word_count - last_word_count > 10000) {
-      word_count_actual += word_count - last_word_count;
-      last_word_count = word_count;
-      if ((debug_mode > 1)) {
-        now = clock();
-        printf("%cAlpha: %f  Objective (w): %f  Objective (d): %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha, 
-               obj_w, obj_d, word_count_actual / (real) (iter * train_words + 1) * 100,
-               word_count_actual / ((real) (now - start + 1) / (real) CLOCKS_PER_SEC * 1000));
-        fflush(stdout);
-      }
-      alpha = starting_alpha * (1 - word_count_actual / (real) (iter * train_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
-    }
-    if (sentence_length == 0) {
-      doc = FindLine(fi);
-      while (1) {
-        word = ReadWordIndex(fi);
-        if (feof(fi)) break;
-        if (word == -1) continue;
-        word_count++;
-        if (word == 0) break;
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) /
-                     vocab[word].cn;
-          next_random = next_random * (unsigned long long) 25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real) 65536) continue;
-        }
-        sen[sentence_length] = word;
-        sentence_length++;
-        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
-      }
-      sentence_position = 0;
-    }
+// Fails the current call with the error of a thread it started and has joined, if one failed
+void CheckThreads() {
+  if (!engine_failed) return;
+  engine_failed = 0;
+  strcpy(last_output, engine_error);
+  exit(1);
+}
 
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long) num_threads * (long long) id, SEEK_SET);
-      continue;
-    }
+// Fails a jose_* call that was used wrongly, with a message for jose_last_error; returns -1
+int ApiError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(api_error, sizeof(api_error), format, args);
+  va_end(args);
+  return -1;
+}
 
-    word = sen[sentence_position];
-    if (word == -1) continue;
-    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
-    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-    next_random = next_random * (unsigned long long) 25214903917 + 11;
-    b = next_random % window;
+const char *jose_last_error(void) {
+  return api_error;
+}
 
-    for (a = b; a < window * 2 + 1 - b; a++)
-      if (a != window) {
-        c = sentence_position - window + a;
-        if (c < 0) continue;
-        if (c >= sentence_length) continue;
-        last_word = sen[c];
-        if (last_word == -1) continue;
-        l1 = last_word * layer1_size; // positive center word u
-        
-        obj_w = 0;
-        for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            l3 = word * layer1_size; // positive context word v
-          } else {
-            next_random = next_random * (unsigned long long) 25214903917 + 11;
-            target = word_table[(next_random >> 16) % table_size];
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
-            if (target == word) continue;
-            l2 = target * layer1_size; // negative center word u'
-            f = 0;
-            for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l3]; // f = cos(v, u) = v * u
-            h = 0;
-            for (c = 0; c < layer1_size; c++) h += syn0[c + l2] * syn1neg[c + l3]; // h = cos(v, u') = v * u'
-        
-            if (f - h < margin) {
-              obj_w += margin - (f - h);
+// Copies the state of model into the globals (enter = 1) or the globals into the state of model (enter = 0)
+void SwapModel(jose_model *model, int enter) {
+  size_t a, offset = 0;
+  for (a = 0; a < NUM_MODEL_VARS; offset += model_vars[a++].size)
+    if (enter) memcpy(model_vars[a].addr, model->state + offset, model_vars[a].size);
+    else memcpy(model->state + offset, model_vars[a].addr, model_vars[a].size);
+}
 
-              // compute context word gradient
-              for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-              for (c = 0; c < layer1_size; c++) neu1e[c] += syn0[c + l1] - f * syn1neg[c + l3] + h * syn1neg[c + l3] - syn0[c + l2];
-              
-              // update positive center word
-              for (c = 0; c < layer1_size; c++) grad[c] = syn1neg[c + l3] - f * syn0[c + l1]; // negative Riemannian gradient
-              step = 1 - f; // cosine distance, d_cos
-              for (c = 0; c < layer1_size; c++) syn0[c + l1] += alpha * step * grad[c];
-              g = 0;
-              for (c = 0; c < layer1_size; c++) g += syn0[c + l1] * syn0[c + l1];
-              g = sqrt(g);
-              for (c = 0; c < layer1_size; c++) syn0[c + l1] /= g;
-
-              // update negative center word
-              for (c = 0; c < layer1_size; c++) grad[c] = h * syn0[c + l2] - syn1neg[c + l3];
-              step = 2 * h; // 2 * negative cosine similarity
-              for (c = 0; c < layer1_size; c++) syn0[c + l2] += alpha * step * grad[c];
-              g = 0;
-              for (c = 0; c < layer1_size; c++) g += syn0[c + l2] * syn0[c + l2];
-              g = sqrt(g);
-              for (c = 0; c < layer1_size; c++) syn0[c + l2] /= g;
-
-              // update context word
-              step = 1 - (f - h);
-              for (c = 0; c < layer1_size; c++) syn1neg[c + l3] += alpha * step * neu1e[c];
-              g = 0;
-              for (c = 0; c < layer1_size; c++) g += syn1neg[c + l3] * syn1neg[c + l3];
-              g = sqrt(g);
-              for (c = 0; c < layer1_size; c++) syn1neg[c + l3] /= g;
-            }
-          }
-        }
-      }
+// Address of the copy of global var in the state of model, for the calls that read a model without the engine
+void *ModelState(jose_model *model, void *var) {
+  size_t a, offset = 0;
+  for (a = 0; model_vars[a].addr != var; offset += model_vars[a++].size);
+  return model->state + offset;
+}
+#define MODEL_STATE(model, x) (*(__typeof__(x) *) ModelState(model, (void *) &(x)))
 
-    obj_d = 0;
-    l1 = doc * layer1_size; // positive document d
-    for (d = 0; d < negative + 1; d++) {
-      if (d == 0) {
-        l3 = word * layer1_size; // positive center word u
-      } else {
-        next_random = next_random * (unsigned long long) 25214903917 + 11;
-        target = word_table[(next_random >> 16) % table_size];
-        if (target == 0) target = next_random % (vocab_size - 1) + 1;
-        if (target == word) continue;
-        l2 = target * layer1_size; // negative center word u'
-      
-        f = 0;
-        for (c = 0; c < layer1_size; c++) f += syn0[c + l3] * syn1doc[c + l1]; // f = cos(u, d) = u * d
-        h = 0;
-        for (c = 0; c < layer1_size; c++) h += syn0[c + l2] * syn1doc[c + l1]; // h = cos(u', d) = u' * d
-    
-        if (f - h < margin) {
-          obj_d += margin - (f - h);
-
-          // compute document gradient
-          for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += syn0[c + l3] - f * syn1doc[c + l1] + h * syn1doc[c + l1] - syn0[c + l2];
-
-          // update positive center word
-          for (c = 0; c < layer1_size; c++) grad[c] = syn1doc[c + l1] - f * syn0[c + l3];
-          step = 1 - f;
-          for (c = 0; c < layer1_size; c++) syn0[c + l3] += alpha * step * grad[c];
-          g = 0;
-          for (c = 0; c < layer1_size; c++) g += syn0[c + l3] * syn0[c + l3];
-          g = sqrt(g);
-          for (c = 0; c < layer1_size; c++) syn0[c + l3] /= g;
-
-          // update negative center word
-          for (c = 0; c < layer1_size; c++) grad[c] = h * syn0[c + l2] - syn1doc[c + l1];
-          step = 2 * h;
-          for (c = 0; c < layer1_size; c++) syn0[c + l2] += alpha * step * grad[c];
-          g = 0;
-          for (c = 0; c < layer1_size; c++) g += syn0[c + l2] * syn0[c + l2];
-          g = sqrt(g);
-          for (c = 0; c < layer1_size; c++) syn0[c + l2] /= g;
-
-          // update document
-          step = 1 - (f - h);
-          for (c = 0; c < layer1_size; c++) syn1doc[c + l1] += alpha * step * neu1e[c];
-          g = 0;
-          for (c = 0; c < layer1_size; c++) g += syn1doc[c + l1] * syn1doc[c + l1];
-          g = sqrt(g);
-          for (c = 0; c < layer1_size; c++) syn1doc[c + l1] /= g;
-        }
-      }
-    }
+// SearchVocab on the state of model, which the caller has locked
+long long ModelWordId(jose_model *model, const char *word) {
+  struct vocab_slot *table = MODEL_STATE(model, vocab_hash);
+  return table[FindSlot(table, MODEL_STATE(model, vocab_hash_size), MODEL_STATE(model, vocab), (char *) word,
+                        GetWordHash((char *) word))].id;
+}
 
-    sentence_position++;
-    if (sentence_position >= sentence_length) {
-      sentence_length = 0;
-      continue;
-    }
+// Takes the engine for model; returns -1 if an earlier error left the model unusable
+int EnterModel(jose_model *model) {
+  pthread_mutex_lock(&model->lock);
+  if (model->broken) {
+    pthread_mutex_unlock(&model->lock);
+    return ApiError("the model is unusable after an earlier error");
   }
-  fclose(fi);
-  free(neu1);
-  free(neu1e);
-  free(grad);
-  pthread_exit(NULL);
+  pthread_mutex_lock(&model_lock);
+  SwapModel(model, 1);
+  engine_call = 1;
+  return 0;
 }
 
-void TrainModel() {
-  long a, b;
-  FILE *fo;
-  pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
-  printf("Starting training using file %s\n", train_file);
+void LeaveModel(jose_model *model) {
+  // a failed thread whose call did not check for it
+  CheckThreads();
+  api_jmp = NULL;
+  engine_call = 0;
+  SwapModel(model, 0);
+  pthread_mutex_unlock(&model_lock);
+  pthread_mutex_unlock(&model->lock);
+}
 
-  starting_alpha = alpha;
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
-  if (save_vocab_file[0] != 0) SaveVocab();
-  
-  InitNet();
-  InitUnigramTable();
-  start = clock();
-  
-  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *) a);
-  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+// Ends a call that failed: a model that the call had begun to change (broken) stays unusable and keeps what the
+// call left, for jose_free; any other keeps its state from before the call
+void FailModel(jose_model *model) {
+  api_jmp = NULL;
+  engine_call = engine_failed = 0;
+  if (model->broken) SwapModel(model, 0);
+  pthread_mutex_unlock(&model_lock);
+  pthread_mutex_unlock(&model->lock);
+}
 
-  if (word_emb[0] != 0) {
-    fo = fopen(word_emb, "wb");
-    fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
-    for (a = 0; a < vocab_size; a++) {
-      fprintf(fo, "%s ", vocab[a].word);
-      for (b = 0; b < layer1_size; b++) {
-        fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
-      }
-      fprintf(fo, "\n");
-    }
-    fclose(fo);
+// Sets the options that jose_set recorded for model, and keeps them even if the call fails
+void ApplyOptions(jose_model *model) {
+  char *argv[3] = {(char *) "jose", NULL, NULL};
+  int a;
+  if (model->num_options == 0) return;
+  for (a = 0; a < model->num_options; a++) {
+    argv[1] = model->options[2 * a];
+    argv[2] = model->options[2 * a + 1];
+    ParseArgs(3, argv);
+    free(argv[1]);
+    free(argv[2]);
   }
-  
-  if (context_emb[0] != 0) {
-    FILE* fa = fopen(context_emb, "wb");
-    fprintf(fa, "%lld %lld\n", vocab_size, layer1_size);
-    for (a = 0; a < vocab_size; a++) {
-      fprintf(fa, "%s ", vocab[a].word);
-      for (b = 0; b < layer1_size; b++) {
-        fprintf(fa, "%lf ", syn1neg[a * layer1_size + b]);
-      }
-      fprintf(fa, "\n");
-    }
-    fclose(fa);
+  model->num_options = 0;
+  SwapModel(model, 0);
+}
+
+// Reads the number of rows and the dimension from the header of an embedding file; returns 0 if it cannot
+int EmbFileShape(char *file, long long *rows, long long *dim) {
+  struct emb_map map;
+  FILE *fin;
+  int ok;
+  if (MapEmb(file, &map)) {
+    *rows = map.header.rows;
+    *dim = map.header.dim;
+    UnmapEmb(&map);
+    return 1;
   }
+  fin = fopen(file, "r");
+  if (fin == NULL) return 0;
+  ok = fscanf(fin, "%lld %lld", rows, dim) == 2;
+  fclose(fin);
+  return ok;
+}
 
-  if (doc_output[0] != 0) {
-    FILE* fd = fopen(doc_output, "wb");
-    fprintf(fd, "%lld %lld\n", corpus_size, layer1_size);
+// Reads the corpus_size document vectors of an embedding file into syn1doc (or syn1doc16)
+void LoadDocRows(char *file) {
+  long long a, b;
+  real *buf = (real *) malloc(layer1_size * sizeof(real)), *row;
+  char name[MAX_STRING];
+  struct emb_map map;
+  FILE *fin;
+  if (MapEmb(file, &map)) {
     for (a = 0; a < corpus_size; a++) {
-      fprintf(fd, "%ld ", a);
-      for (b = 0; b < layer1_size; b++) {
-        fprintf(fd, "%lf ", syn1doc[a * layer1_size + b]);
-      }
-      fprintf(fd, "\n");
+      row = DocRow(a, buf, 0);
+      memcpy(row, map.data + a * layer1_size, layer1_size * sizeof(real));
+      StoreDocRow(a, row);
+    }
+    UnmapEmb(&map);
+  } else {
+    fin = fopen(file, "r");
+    if (fin == NULL || fscanf(fin, "%lld %lld", &a, &b) != 2) {
+      printf("ERROR: cannot read embedding file %s\n", file);
+      exit(1);
+    }
+    for (a = 0; a < corpus_size; a++) {
+      row = DocRow(a, buf, 0);
+      if (fscanf(fin, "%s", name) != 1) break;
+      for (b = 0; b < layer1_size; b++) if (fscanf(fin, "%f", &row[b]) != 1) break;
+      StoreDocRow(a, row);
+    }
+    fclose(fin);
+    if (a < corpus_size) {
+      printf("ERROR: embedding file %s is truncated\n", file);
+      exit(1);
     }
-    fclose(fd);
   }
+  free(buf);
 }
 
-int ArgPos(char *str, int argc, char **argv) {
+// Starts a jose_* call that runs the engine on model. An error in the call returns fail from it, with the model as
+// it was unless the call had set model->broken before changing it.
+#define ENTER_MODEL(model, fail)           \
+  jmp_buf on_error;                        \
+  if (EnterModel(model) != 0) return fail; \
+  if (setjmp(on_error)) {                  \
+    FailModel(model);                      \
+    return fail;                           \
+  }                                        \
+  api_jmp = &on_error;                     \
+  ApplyOptions(model)
+
+jose_model *jose_new(void) {
+  size_t a;
+  jose_model *model = (jose_model *) calloc(1, sizeof(jose_model));
+  pthread_mutex_init(&model->lock, NULL);
+  pthread_mutex_lock(&model_lock);
+  if (model_defaults == NULL) {
+    for (a = 0; a < NUM_MODEL_VARS; a++) model_state_size += model_vars[a].size;
+    model->state = model_defaults = (char *) malloc(model_state_size);
+    SwapModel(model, 0);
+  }
+  model->state = (char *) malloc(model_state_size);
+  memcpy(model->state, model_defaults, model_state_size);
+  SwapModel(model, 1);
+  vocab = (struct vocab_word *) calloc(vocab_max_size, sizeof(struct vocab_word));
+  vocab_hash = BuildVocabHash(NULL, &vocab_hash_size, vocab, 0);
+  if (kernels == NULL) SelectKernels();
+  SwapModel(model, 0);
+  pthread_mutex_unlock(&model_lock);
+  return model;
+}
+
+void jose_free(jose_model *model) {
   int a;
-  for (a = 1; a < argc; a++)
-    if (!strcmp(str, argv[a])) {
-      if (a == argc - 1) {
-        printf("Argument missing for %s\n", str);
-        exit(1);
-      }
-      return a;
-    }
-  return -1;
+  pthread_mutex_lock(&model->lock);
+  pthread_mutex_lock(&model_lock);
+  SwapModel(model, 1);
+  // matrices of a resumed checkpoint live in its mapping, and those of -doc-mmap in the output file; a model broken
+  // by an error may not have all of its rows, and its matrices are left alone
+  if (!resume && !model->broken) {
+    FreeMatrix(syn0, vocab_size, layer1_size * sizeof(real));
+    FreeMatrix(syn1neg, vocab_size, layer1_size * sizeof(real));
+    if (!doc_mmap) FreeMatrix(doc_precision ? (void *) syn1doc16 : (void *) syn1doc, corpus_size, DocRowBytes());
+  }
+  FreeArena(&vocab_arena);
+  free(vocab);
+  free(vocab_hash);
+  free(word_table);
+  free(alias_table);
+  free(chunk_starts);
+  free(chunk_docs);
+  free(chunk_queues);
+  free(thread_stats);
+  free(infer_docs);
+  syn0 = syn1neg = syn1doc = infer_docs = NULL;
+  syn1doc16 = NULL;
+  SwapModel(model, 0);
+  pthread_mutex_unlock(&model_lock);
+  pthread_mutex_unlock(&model->lock);
+  for (a = 0; a < 2 * model->num_options; a++) free(model->options[a]);
+  free(model->options);
+  pthread_mutex_destroy(&model->lock);
+  free(model->state);
+  free(model);
+}
+
+// Options are recorded and set when the model next runs the engine, so that setting them does not wait for the
+// calls on other models. -kernels applies to the whole process and is set right away.
+int jose_set(jose_model *model, const char *option, const char *value) {
+  char *argv[3] = {(char *) "jose", (char *) option, (char *) value}, keep[MAX_STRING];
+  jmp_buf on_error;
+  int ret = 0;
+  if (strlen(value) >= MAX_STRING) return ApiError("the value of %s is too long", option);
+  args_matched = 0;
+  args_dry_run = 1;
+  ParseArgs(3, argv);
+  args_dry_run = 0;
+  if (args_matched != 1) return ApiError("unknown option %s", option);
+  if (!strcmp(option, "-kernels")) {
+    pthread_mutex_lock(&model_lock);
+    strcpy(keep, kernel_name);
+    strcpy(kernel_name, value);
+    api_jmp = &on_error;
+    if (setjmp(on_error)) {
+      strcpy(kernel_name, keep);
+      ret = -1;
+    } else SelectKernels();
+    api_jmp = NULL;
+    pthread_mutex_unlock(&model_lock);
+    return ret;
+  }
+  pthread_mutex_lock(&model->lock);
+  model->options = (char **) realloc(model->options, 2 * (model->num_options + 1) * sizeof(char *));
+  model->options[2 * model->num_options] = strdup(option);
+  model->options[2 * model->num_options + 1] = strdup(value);
+  model->num_options++;
+  pthread_mutex_unlock(&model->lock);
+  return 0;
+}
+
+int jose_build_vocab(jose_model *model, const char *file) {
+  ENTER_MODEL(model, -1);
+  if (vocab_size > 0 || strlen(file) >= MAX_STRING) {
+    LeaveModel(model);
+    return ApiError(vocab_size > 0 ? "the model has a vocabulary already" : "file name too long");
+  }
+  strcpy(train_file, file);
+  CheckArgs();
+  if (read_vocab_file[0] == 0 && access(train_file, R_OK) == -1) {
+    LeaveModel(model);
+    return ApiError("cannot read %s", train_file);
+  }
+  model->broken = 1;
+  if (read_vocab_file[0] != 0) ReadVocab();
+  else LearnVocabFromTrainFile();
+  if (save_vocab_file[0] != 0) SaveVocab(save_vocab_file);
+  // jose_train chunks its training file again, which need not be this one
+  num_chunks = corpus_size = 0;
+  model->broken = 0;
+  LeaveModel(model);
+  return 0;
+}
+
+int jose_train(jose_model *model, const char *file) {
+  ENTER_MODEL(model, -1);
+  if (syn0 != NULL || infer || strlen(file) >= MAX_STRING) {
+    LeaveModel(model);
+    return ApiError(infer ? "-infer is set" : syn0 != NULL ? "the model was trained or loaded before"
+                                                           : "file name too long");
+  }
+  strcpy(train_file, file);
+  CheckArgs();
+  if (access(train_file, R_OK) == -1) {
+    LeaveModel(model);
+    return ApiError("cannot read %s", train_file);
+  }
+  model->broken = 1;
+  TrainModel();
+  model->broken = 0;
+  LeaveModel(model);
+  return 0;
+}
+
+long long jose_infer(jose_model *model, const char *file, const char *output) {
+  long long docs, rows;
+  real *docs32;
+  unsigned short *docs16;
+  char keep_output[MAX_STRING];
+  ENTER_MODEL(model, -1);
+  if (syn0 == NULL || strlen(file) >= MAX_STRING || (output != NULL && strlen(output) >= MAX_STRING)) {
+    LeaveModel(model);
+    return ApiError(syn0 == NULL ? "the model has no word vectors to infer with" : "file name too long");
+  }
+  if (access(file, R_OK) == -1) {
+    LeaveModel(model);
+    return ApiError("cannot read %s", file);
+  }
+  model->broken = 1;
+  strcpy(train_file, file);
+  strcpy(keep_output, doc_output);
+  strcpy(doc_output, output != NULL ? output : "");
+  free(infer_docs);
+  infer_docs = NULL;
+  if (word_table == NULL && alias_table == NULL) InitUnigramTable();
+  // syn1doc only holds the block of documents being inferred; the trained ones are set aside meanwhile
+  docs = corpus_size;
+  docs32 = syn1doc;
+  docs16 = syn1doc16;
+  corpus_size = infer_block;
+  if (doc_precision) syn1doc16 = (unsigned short *) AllocMatrix(corpus_size, DocRowBytes(), (char *) "syn1doc");
+  else syn1doc = (real *) AllocMatrix(corpus_size, DocRowBytes(), (char *) "syn1doc");
+  InferDocs();
+  FreeMatrix(doc_precision ? (void *) syn1doc16 : (void *) syn1doc, corpus_size, DocRowBytes());
+  corpus_size = docs;
+  syn1doc = docs32;
+  syn1doc16 = docs16;
+  strcpy(doc_output, keep_output);
+  rows = infer_rows;
+  model->broken = 0;
+  LeaveModel(model);
+  return rows;
+}
+
+// Rows [begin, end) of a matrix scored against one query vector by a thread of jose_query, into a top-k heap
+struct query_job {
+  real *vec, *rows;
+  long long begin, end, skip, dim;
+  int k;
+  struct query_hit *heap;
+};
+
+void *QueryJobThread(void *arg) {
+  struct query_job *job = (struct query_job *) arg;
+  long long a, r, tile = QUERY_TILE_ROWS;
+  real sims[QUERY_TILE_ROWS];
+  for (a = 0; a < job->k; a++) {
+    job->heap[a].id = -1;
+    job->heap[a].score = -2;
+  }
+  for (r = job->begin; r < job->end; r += tile) {
+    if (r + tile > job->end) tile = job->end - r;
+    MatVec(job->rows + r * job->dim, tile, job->vec, sims, job->dim);
+    for (a = 0; a < tile; a++)
+      if (r + a != job->skip) PushHit(job->heap, job->k, r + a, sims[a]);
+  }
+  pthread_exit(NULL);
+}
+
+// Reads the model's own state instead of running the engine, so it does not wait for the calls on other models
+int jose_query(jose_model *model, const char *query, int type, int k, long long *ids, float *scores) {
+  long long a, q, dim, src_rows, dst_rows, threads;
+  real *src, *dst;
+  int n;
+  pthread_t *pt;
+  struct query_job *jobs;
+  struct query_hit *hits;
+  pthread_mutex_lock(&model->lock);
+  src = MODEL_STATE(model, syn0);
+  dst = MODEL_STATE(model, syn1doc);
+  if (k <= 0 || type < 0 || type > 2) {
+    pthread_mutex_unlock(&model->lock);
+    return ApiError("invalid k or type");
+  }
+  if (src == NULL || (type != 0 && dst == NULL)) {
+    pthread_mutex_unlock(&model->lock);
+    return ApiError(src == NULL ? "the model has no vectors" : "the model has no float32 document vectors");
+  }
+  dim = MODEL_STATE(model, layer1_size);
+  threads = MODEL_STATE(model, num_threads);
+  src_rows = MODEL_STATE(model, vocab_size);
+  dst_rows = MODEL_STATE(model, corpus_size);
+  if (type == 0) {
+    dst = src;
+    dst_rows = src_rows;
+  }
+  if (type == 2) {
+    q = atoll(query);
+    if (q < 0 || q >= dst_rows) q = -1;
+    src = dst;
+  } else q = ModelWordId(model, query);
+  if (q < 0) {
+    pthread_mutex_unlock(&model->lock);
+    return ApiError("unknown %s %s", type == 2 ? "document" : "word", query);
+  }
+  if (threads > dst_rows) threads = dst_rows > 0 ? dst_rows : 1;
+  jobs = (struct query_job *) malloc(threads * sizeof(struct query_job));
+  hits = (struct query_hit *) malloc(threads * k * sizeof(struct query_hit));
+  pt = (pthread_t *) malloc(threads * sizeof(pthread_t));
+  for (a = 0; a < threads; a++) {
+    jobs[a].vec = src + q * dim;
+    jobs[a].rows = dst;
+    jobs[a].begin = (dst_rows + threads - 1) / threads * a;
+    jobs[a].end = jobs[a].begin + (dst_rows + threads - 1) / threads;
+    if (jobs[a].end > dst_rows) jobs[a].end = dst_rows;
+    // a word or document is not reported as its own neighbour
+    jobs[a].skip = src == dst ? q : -1;
+    jobs[a].dim = dim;
+    jobs[a].k = k;
+    jobs[a].heap = hits + a * k;
+    pthread_create(&pt[a], NULL, QueryJobThread, (void *) &jobs[a]);
+  }
+  for (a = 0; a < threads; a++) pthread_join(pt[a], NULL);
+  pthread_mutex_unlock(&model->lock);
+  // the slots a thread did not fill score -2 and sort last
+  qsort(hits, threads * k, sizeof(struct query_hit), HitCompare);
+  for (n = 0; n < k && hits[n].id >= 0; n++) {
+    ids[n] = hits[n].id;
+    scores[n] = hits[n].score;
+  }
+  free(jobs);
+  free(hits);
+  free(pt);
+  return n;
+}
+
+int jose_save(jose_model *model, const char *prefix) {
+  char file[MAX_STRING + 16];
+  const char *ext;
+  FILE *fo;
+  ENTER_MODEL(model, -1);
+  if (syn0 == NULL || strlen(prefix) >= MAX_STRING) {
+    LeaveModel(model);
+    return ApiError(syn0 == NULL ? "the model has no vectors to save" : "file name too long");
+  }
+  ext = binary ? "bin" : "txt";
+  sprintf(file, "%s_vocab.txt", prefix);
+  SaveVocab(file);
+  sprintf(file, "%s_w.%s", prefix, ext);
+  SaveEmb(file, syn0, vocab_size, 1);
+  sprintf(file, "%s_v.%s", prefix, ext);
+  SaveEmb(file, syn1neg, vocab_size, 1);
+  if (corpus_size > 0 && (syn1doc != NULL || syn1doc16 != NULL)) {
+    sprintf(file, "%s_d.%s", prefix, ext);
+    fo = StartEmbFile(file, corpus_size, 0);
+    WriteDocRows(fo, 0, corpus_size);
+    FinishEmbFile(fo, file, -1);
+  }
+  LeaveModel(model);
+  return 0;
+}
+
+int jose_load(jose_model *model, const char *prefix) {
+  char file[MAX_STRING + 16], doc_file[MAX_STRING + 16], keep_vocab[MAX_STRING], keep_emb[MAX_STRING];
+  long long rows, dim;
+  ENTER_MODEL(model, -1);
+  if (vocab_size > 0 || syn0 != NULL || doc_mmap || strlen(prefix) >= MAX_STRING - 16) {
+    LeaveModel(model);
+    return ApiError(doc_mmap ? "-doc-mmap is set" : vocab_size > 0 || syn0 != NULL ? "the model is not empty"
+                                                                                   : "file name too long");
+  }
+  sprintf(file, "%s_vocab.txt", prefix);
+  if (access(file, R_OK) == -1) {
+    LeaveModel(model);
+    return ApiError("cannot read %s", file);
+  }
+  model->broken = 1;
+  strcpy(keep_vocab, read_vocab_file);
+  strcpy(keep_emb, load_emb_file);
+  strcpy(read_vocab_file, file);
+  strcpy(load_emb_file, prefix);
+  ReadVocab();
+  // binary files take precedence over text ones, as in InitNet
+  sprintf(file, "%s_w.bin", prefix);
+  if (access(file, R_OK) == -1) sprintf(file, "%s_w.txt", prefix);
+  if (!EmbFileShape(file, &rows, &layer1_size)) {
+    printf("ERROR: cannot read embedding file %s\n", file);
+    exit(1);
+  }
+  sprintf(doc_file, "%s_d.bin", prefix);
+  if (access(doc_file, R_OK) == -1) sprintf(doc_file, "%s_d.txt", prefix);
+  corpus_size = 0;
+  if (EmbFileShape(doc_file, &corpus_size, &dim) && dim != layer1_size) {
+    printf("ERROR: %s and %s have different dimensions!\n", file, doc_file);
+    exit(1);
+  }
+  if (numa && thread_nodes == NULL) InitNumaTopology();
+  InitNet();
+  if (corpus_size > 0) LoadDocRows(doc_file);
+  strcpy(read_vocab_file, keep_vocab);
+  strcpy(load_emb_file, keep_emb);
+  model->broken = 0;
+  LeaveModel(model);
+  return 0;
+}
+
+// The calls below read the model's own state, like jose_query
+long long jose_vocab_size(jose_model *model) {
+  long long n;
+  pthread_mutex_lock(&model->lock);
+  n = MODEL_STATE(model, vocab_size);
+  pthread_mutex_unlock(&model->lock);
+  return n;
+}
+
+long long jose_num_docs(jose_model *model) {
+  long long n;
+  pthread_mutex_lock(&model->lock);
+  n = MODEL_STATE(model, syn0) != NULL ? MODEL_STATE(model, corpus_size) : 0;
+  pthread_mutex_unlock(&model->lock);
+  return n;
+}
+
+long long jose_dim(jose_model *model) {
+  long long n;
+  pthread_mutex_lock(&model->lock);
+  n = MODEL_STATE(model, layer1_size);
+  pthread_mutex_unlock(&model->lock);
+  return n;
+}
+
+const char *jose_word(jose_model *model, long long id) {
+  const char *word;
+  pthread_mutex_lock(&model->lock);
+  word = id >= 0 && id < MODEL_STATE(model, vocab_size) ? MODEL_STATE(model, vocab)[id].word : NULL;
+  pthread_mutex_unlock(&model->lock);
+  return word;
+}
+
+long long jose_word_id(jose_model *model, const char *word) {
+  long long id;
+  pthread_mutex_lock(&model->lock);
+  id = ModelWordId(model, word);
+  pthread_mutex_unlock(&model->lock);
+  return id;
+}
+
+float *jose_word_vectors(jose_model *model) {
+  float *p;
+  pthread_mutex_lock(&model->lock);
+  p = MODEL_STATE(model, syn0);
+  pthread_mutex_unlock(&model->lock);
+  return p;
+}
+
+float *jose_context_vectors(jose_model *model) {
+  float *p;
+  pthread_mutex_lock(&model->lock);
+  p = MODEL_STATE(model, syn1neg);
+  pthread_mutex_unlock(&model->lock);
+  return p;
+}
+
+float *jose_doc_vectors(jose_model *model) {
+  float *p;
+  pthread_mutex_lock(&model->lock);
+  p = MODEL_STATE(model, syn1doc);
+  pthread_mutex_unlock(&model->lock);
+  return p;
+}
+
+float *jose_inferred_vectors(jose_model *model, long long *rows) {
+  float *p;
+  pthread_mutex_lock(&model->lock);
+  p = MODEL_STATE(model, infer_docs);
+  *rows = MODEL_STATE(model, infer_rows);
+  pthread_mutex_unlock(&model->lock);
+  return p;
 }
 
+#ifndef JOSE_LIBRARY
 int main(int argc, char **argv) {
-  int i;
   if (argc == 1) {
     printf("Parameters:\n");
     printf("\t-train <file> (mandatory argument)\n");
@@ -696,6 +4950,9 @@ int main(int argc, char **argv) {
     printf("\t\tUse <file> to save the resulting word context vectors\n");
     printf("\t-doc-output <file>\n");
     printf("\t\tUse <file> to save the resulting document vectors\n");
+    printf("\t-binary <int>\n");
+    printf("\t\tSave the resulting vectors in the binary format (header, row names, aligned float32 matrix) that can\n");
+    printf("\t\tbe memory-mapped by -load-emb and numpy.memmap (see emb_io.py); default is 0 (text)\n");
     printf("\t-size <int>\n");
     printf("\t\tSet size of word vectors; default is 100\n");
     printf("\t-window <int>\n");
@@ -705,6 +4962,9 @@ int main(int argc, char **argv) {
     printf("\t\ttraining data will be randomly down-sampled; default is 1e-3, useful range is (0, 1e-3)\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 2\n");
+    printf("\t-sampler <int>\n");
+    printf("\t\tNegative sampler: 0 = 1e8-entry unigram table, 1 = alias table (O(vocabulary) memory) drawing\n");
+    printf("\t\tbatches of negatives per thread from a vectorised generator; default is 0\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads; default is 20\n");
     printf("\t-margin <float>\n");
@@ -722,7 +4982,102 @@ int main(int argc, char **argv) {
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
     printf("\t-load-emb <file>\n");
-    printf("\t\tThe pretrained embeddings will be read from <file>\n");
+    printf("\t\tThe pretrained embeddings will be read from <file>_w and <file>_v (.bin if present, otherwise .txt)\n");
+    printf("\t-batch <int>\n");
+    printf("\t\tUpdate each window (and each document step) as one minibatch that shares the dot products with the\n");
+    printf("\t\tcenter word; default is 0 (off)\n");
+    printf("\t-kernels <name>\n");
+    printf("\t\tUse the sse, avx2 or avx512 row kernels instead of the widest ones the cpu supports\n");
+    printf("\t-prefetch <int>\n");
+    printf("\t\tGive every training thread a reader thread that reads, tokenises and subsamples its input up to <int>\n");
+    printf("\t\tblocks of sentences ahead (2 for double buffering), so that training does not wait for slow storage;\n");
+    printf("\t\tdefault is 0 (off); cannot be used with -checkpoint\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tEvery thread trains the <int> most frequent word and context vectors in private copies, merged into the\n");
+    printf("\t\tshared ones every 10000 words, to avoid contention on them with many threads; default is 0 (off)\n");
+    printf("\t-infer <int>\n");
+    printf("\t\tInfer vectors for the documents of the -train file (\"-\" for stdin) into -doc-output, keeping the\n");
+    printf("\t\tword vectors of -load-emb frozen; needs the -read-vocab of the trained model; default is 0 (off)\n");
+    printf("\t-infer-block <int>\n");
+    printf("\t\tNumber of documents read and inferred at a time in -infer mode; default is 100000\n");
+    printf("\t-query <file>\n");
+    printf("\t\tInstead of training, answer the top-k cosine similarity queries in <file> (\"-\" for stdin), one word or\n");
+    printf("\t\tdocument index per token, against the vectors of -load-emb (<file>_w) and -load-doc\n");
+    printf("\t-query-type <int>\n");
+    printf("\t\tQueries and targets: 0 = word to words, 1 = word to documents, 2 = document to documents; default is 0\n");
+    printf("\t-top-k <int>\n");
+    printf("\t\tNumber of neighbours returned per query; default is 10\n");
+    printf("\t-query-output <file>\n");
+    printf("\t\tWrite the query results to <file> instead of stdout\n");
+    printf("\t-load-doc <file>\n");
+    printf("\t\tThe document vectors (as written by -doc-output) searched by -query-type 1 and 2, or updated by -incremental\n");
+    printf("\t-ann-index <file>\n");
+    printf("\t\tAfter training, build an approximate nearest-neighbour graph over the document vectors into <file>;\n");
+    printf("\t\twith -query, search the -load-doc vectors through the index in <file> instead of exhaustively\n");
+    printf("\t-ann-m <int>\n");
+    printf("\t\tNumber of neighbours per node in the index (twice as many on the bottom level); default is 16\n");
+    printf("\t-ann-ef-construction <int>\n");
+    printf("\t\tCandidate list size while building the index; larger is slower but gives a better graph; default is 100\n");
+    printf("\t-ann-ef <int>\n");
+    printf("\t\tCandidate list size of an index query (at least -top-k); larger trades latency for recall; default is 50\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tPeriodically save the training state (parameters, vocabulary and progress) to <file>\n");
+    printf("\t-checkpoint-interval <int>\n");
+    printf("\t\tSeconds between two checkpoints; default is 1800\n");
+    printf("\t-resume <int>\n");
+    printf("\t\tContinue the training saved in -checkpoint (with the same -train, -size, -threads and -cache);\n");
+    printf("\t\tdefault is 0 (off)\n");
+    printf("\t-chunk-words <int>\n");
+    printf("\t\tThreads take the training data in chunks of whole documents with about <int> words each, stealing\n");
+    printf("\t\tchunks from each other once their own are done; smaller on corpora too small for two chunks per\n");
+    printf("\t\tthread; default is 100000\n");
+    printf("\t-numa <int>\n");
+    printf("\t\tPin the training threads to cpus node by node, interleave the word matrices over the NUMA nodes\n");
+    printf("\t\tand place the document vectors on the node of the threads training them; default is 0 (off)\n");
+    printf("\t-doc-precision <int>\n");
+    printf("\t\tStore the document vectors as 0 = float32, 1 = bfloat16 or 2 = float16, halving their memory with\n");
+    printf("\t\t1 and 2; training converts each to float32 and back once per sentence; default is 0\n");
+    printf("\t-doc-mmap <int>\n");
+    printf("\t\tKeep the document vectors in the binary -doc-output file, mapped into memory, instead of RAM; the\n");
+    printf("\t\toperating system pages rows in and out as training moves through the corpus; default is 0 (off)\n");
+    printf("\t-incremental <int>\n");
+    printf("\t\tTrain only the new and changed documents of -train on top of an old model given by its -read-vocab,\n");
+    printf("\t\t-load-emb and -load-doc, merging the word counts; -doc-output receives all documents; default is 0 (off)\n");
+    printf("\t-doc-ids <file>\n");
+    printf("\t\tWith -incremental, one line per document of -train: the -load-doc row it replaces, or -1 for a new\n");
+    printf("\t\tdocument appended at the end; without it all documents are new\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tNumber of worker processes training together, each on its own -train shard with the -read-vocab of\n");
+    printf("\t\tthe whole corpus; they sync the word and context vectors through -sync-server; default is 1\n");
+    printf("\t-rank <int>\n");
+    printf("\t\tIndex of this worker, below -workers; rank 0 also runs the sync server; default is 0\n");
+    printf("\t-sync-server <address>\n");
+    printf("\t\tWhere rank 0 serves the word and context vectors: a Unix socket path or a TCP host:port\n");
+    printf("\t-sync-interval <float>\n");
+    printf("\t\tSeconds between two syncs of a worker; default is 1\n");
+    printf("\t-stats-file <file>\n");
+    printf("\t\tAppend a JSON line with the training rate, read time share, margin violation rates and objectives\n");
+    printf("\t\tof every thread to <file> every -stats-interval seconds\n");
+    printf("\t-stats-interval <int>\n");
+    printf("\t\tSeconds between two lines of the -stats-file; default is 10\n");
+    printf("\t-eval-sim <file>\n");
+    printf("\t\tAfter every epoch, print the Spearman correlation of the word similarities with the human scores of\n");
+    printf("\t\t<file> (WordSim353, MEN or SimLex-999 format); may be given for up to 8 datasets\n");
+    printf("\t-eval-labels <file>\n");
+    printf("\t\tAfter every epoch, cluster a sample of the document vectors by spherical k-means and print the NMI\n");
+    printf("\t\twith the labels in <file>, one per document and line\n");
+    printf("\t-eval-docs <int>\n");
+    printf("\t\tNumber of documents clustered for -eval-labels; default is 10000\n");
+    printf("\t-eval-k <int>\n");
+    printf("\t\tNumber of clusters for -eval-labels; default is the number of labels\n");
+    printf("\t-early-stop <int>\n");
+    printf("\t\tStop training once the mean of the evaluations (the objective without -eval-sim and -eval-labels)\n");
+    printf("\t\thas not improved by more than -early-stop-delta for <int> epochs; default is 0 (off)\n");
+    printf("\t-early-stop-delta <float>\n");
+    printf("\t\tSmallest improvement that counts for -early-stop; default is 0.001\n");
+    printf("\t-cache <file>\n");
+    printf("\t\tTokenize the training data once into the binary <file> and train from its memory map; an existing\n");
+    printf("\t\t<file> built for the same vocabulary (e.g. with -read-vocab) is reused\n");
     printf("\nExamples:\n");
     printf(
         "./jose -train text.txt -word-output jose.txt -size 100 -margin 0.15 -window 5 -sample 1e-3 -negative 2 -iter 10\n\n");
@@ -731,30 +5086,21 @@ int main(int argc, char **argv) {
   word_emb[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
-  if ((i = ArgPos((char *) "-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
-  if ((i = ArgPos((char *) "-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
-  if ((i = ArgPos((char *) "-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
-  if ((i = ArgPos((char *) "-load-emb", argc, argv)) > 0) strcpy(load_emb_file, argv[i + 1]);
-  if ((i = ArgPos((char *) "-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
-  if ((i = ArgPos((char *) "-word-output", argc, argv)) > 0) strcpy(word_emb, argv[i + 1]);
-  if ((i = ArgPos((char *) "-context-output", argc, argv)) > 0) strcpy(context_emb, argv[i + 1]);
-  if ((i = ArgPos((char *) "-doc-output", argc, argv)) > 0) strcpy(doc_output, argv[i + 1]);
-  if ((i = ArgPos((char *) "-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
-  if ((i = ArgPos((char *) "-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-margin", argc, argv)) > 0) margin = atof(argv[i + 1]);
-  if ((i = ArgPos((char *) "-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *) "-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  ParseArgs(argc, argv);
   vocab = (struct vocab_word *) calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *) calloc(vocab_hash_size, sizeof(int));
-  doc_sizes = (long long *) calloc(corpus_max_size, sizeof(long long));
-  if (negative <= 0) {
-    printf("ERROR: Nubmer of negative samples must be positive!\n");
-    exit(1);
+  vocab_hash = BuildVocabHash(NULL, &vocab_hash_size, vocab, 0);
+  CheckArgs();
+  SelectKernels();
+  if (query_file[0] != 0) {
+    if (query_type < 0 || query_type > 2 || top_k <= 0 || (query_type != 2 && load_emb_file[0] == 0) ||
+        (query_type != 0 && load_doc_file[0] == 0)) {
+      printf("ERROR: -query needs -load-emb for word queries, -load-doc for document targets and a positive -top-k!\n");
+      exit(1);
+    }
+    RunQueries();
+    return 0;
   }
   TrainModel();
   return 0;
 }
+#endif
@@ -0,0 +1,70 @@
+//  C interface of libjose (make libjose.so): trains, infers and queries spherical text embeddings inside the
+//  calling process. Every model is a jose_model context, so a process can hold any number of them, and each call
+//  uses the -threads of its model. Calls on one model run one at a time. Calls that build, train, infer, save or
+//  load run one at a time across all models, as they share the engine; the others (options other than -kernels,
+//  queries, words and vectors) only wait for calls on the same model.
+//
+//  Options are the command line options of jose, set one at a time with jose_set; they take effect at the next
+//  call that builds, trains, infers, saves or loads. A failing call returns -1, and jose_last_error tells
+//  why, also when one of the threads of the call failed. If it failed after it began to change the model (a corrupt
+//  input file, say), the model can only be freed. -workers is only available in the jose command. The vectors are
+//  returned in place, as row-major float32 matrices owned by the model and valid until it is changed or freed.
+
+#ifndef JOSE_H
+#define JOSE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct jose_model jose_model;
+
+// A model with the default options; free it with jose_free
+jose_model *jose_new(void);
+void jose_free(jose_model *model);
+
+// Sets a command line option, e.g. jose_set(model, "-size", "100"); returns -1 for an unknown option
+int jose_set(jose_model *model, const char *option, const char *value);
+
+// Why the last failing call of the calling thread failed
+const char *jose_last_error(void);
+
+// Counts the vocabulary of train_file (or reads the -read-vocab); jose_train then reuses it
+int jose_build_vocab(jose_model *model, const char *train_file);
+
+// Trains the word, context and document vectors on train_file, one document per line, also writing the output
+// files whose options are set; fails if the model was trained or loaded before
+int jose_train(jose_model *model, const char *train_file);
+
+// Infers vectors for the documents of text_file with the word vectors frozen, into the embedding file doc_output,
+// or into the model (see jose_inferred_vectors) when doc_output is NULL; returns the number of documents
+long long jose_infer(jose_model *model, const char *text_file, const char *doc_output);
+
+// Finds the k nearest neighbours by cosine similarity of a word (type 0: among words, 1: among documents) or of
+// document number query (type 2: among documents), writing their ids and similarities best first; returns how many
+// were found (-1 for an unknown word or document)
+int jose_query(jose_model *model, const char *query, int type, int k, long long *ids, float *scores);
+
+// Saves the vocabulary to <prefix>_vocab.txt and the word, context and document vectors to <prefix>_w, <prefix>_v
+// and <prefix>_d (.bin with -binary 1, .txt otherwise); jose_load reads them back into an empty model
+int jose_save(jose_model *model, const char *prefix);
+int jose_load(jose_model *model, const char *prefix);
+
+long long jose_vocab_size(jose_model *model);
+long long jose_num_docs(jose_model *model);
+long long jose_dim(jose_model *model);
+const char *jose_word(jose_model *model, long long id);
+long long jose_word_id(jose_model *model, const char *word);
+
+// vocab_size x dim word and context vectors, num_docs x dim document vectors (NULL with -doc-precision 1 or 2,
+// which keeps them in 16 bits) and the rows x dim vectors of the last jose_infer without an output file
+float *jose_word_vectors(jose_model *model);
+float *jose_context_vectors(jose_model *model);
+float *jose_doc_vectors(jose_model *model);
+float *jose_inferred_vectors(jose_model *model, long long *rows);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+//  Row kernels of the training loop and the queries, written once against the vector primitives below. jose.c
+//  includes this file once per instruction set, with KERNEL_ISA naming the set and KERNEL_LEVEL choosing the
+//  primitives: 0 for the widest enabled at compile time, 1 for SSE, 2 for AVX2 and FMA, 3 for AVX-512. Every function
+//  name gets the suffix _<KERNEL_ISA>, and the table kernels_<KERNEL_ISA> collects the set for SelectKernels.
+
+#ifndef KERNEL
+#define KERNEL_PASTE(name, isa) name##_##isa
+#define KERNEL_NAME(name, isa) KERNEL_PASTE(name, isa)
+#define KERNEL(name) KERNEL_NAME(name, KERNEL_ISA)
+#define KERNEL_QUOTE(isa) #isa
+#define KERNEL_STRING(isa) KERNEL_QUOTE(isa)
+#endif
+
+#if KERNEL_LEVEL > 0
+#define KERNEL_VEC KERNEL_LEVEL
+#elif defined(__AVX512F__)
+#define KERNEL_VEC 3
+#elif defined(__AVX2__) && defined(__FMA__)
+#define KERNEL_VEC 2
+#else
+#define KERNEL_VEC 0
+#endif
+
+#if KERNEL_VEC == 3
+#define VLEN 16
+#define vreal __m512
+#define VZERO() _mm512_setzero_ps()
+#define VSET1(x) _mm512_set1_ps(x)
+#define VLOAD(p) _mm512_loadu_ps(p)
+#define VSTORE(p, v) _mm512_storeu_ps(p, v)
+#define VSUB(a, b) _mm512_sub_ps(a, b)
+#define VMUL(a, b) _mm512_mul_ps(a, b)
+#define VFMADD(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define VSUM(v) _mm512_reduce_add_ps(v)
+#elif KERNEL_VEC == 2
+#define VLEN 8
+#define vreal __m256
+#define VZERO() _mm256_setzero_ps()
+#define VSET1(x) _mm256_set1_ps(x)
+#define VLOAD(p) _mm256_loadu_ps(p)
+#define VSTORE(p, v) _mm256_storeu_ps(p, v)
+#define VSUB(a, b) _mm256_sub_ps(a, b)
+#define VMUL(a, b) _mm256_mul_ps(a, b)
+#define VFMADD(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define VSUM(v) KERNEL(VSum)(v)
+static inline real KERNEL(VSum)(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  return _mm_cvtss_f32(s);
+}
+#elif KERNEL_VEC == 1
+// SSE has no fused multiply-add
+#define VLEN 4
+#define vreal __m128
+#define VZERO() _mm_setzero_ps()
+#define VSET1(x) _mm_set1_ps(x)
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSTORE(p, v) _mm_storeu_ps(p, v)
+#define VSUB(a, b) _mm_sub_ps(a, b)
+#define VMUL(a, b) _mm_mul_ps(a, b)
+#define VFMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define VSUM(v) KERNEL(VSum)(v)
+static inline real KERNEL(VSum)(__m128 v) {
+  __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#else
+#define VLEN 1
+#define vreal real
+#define VZERO() ((real) 0)
+#define VSET1(x) ((real) (x))
+#define VLOAD(p) (*(p))
+#define VSTORE(p, v) (*(p) = (v))
+#define VSUB(a, b) ((a) - (b))
+#define VMUL(a, b) ((a) * (b))
+#define VFMADD(a, b, c) ((a) * (b) + (c))
+#define VSUM(v) (v)
+#endif
+
+// Computes f = a * c and h = b * c in a single pass over the rows
+static inline void KERNEL(Dot2)(const real *a, const real *b, const real *c, long long n, real *f, real *h) {
+  long long i = 0;
+  vreal vf = VZERO(), vh = VZERO(), vc;
+  real sf, sh;
+  for (; i + VLEN <= n; i += VLEN) {
+    vc = VLOAD(c + i);
+    vf = VFMADD(VLOAD(a + i), vc, vf);
+    vh = VFMADD(VLOAD(b + i), vc, vh);
+  }
+  sf = VSUM(vf);
+  sh = VSUM(vh);
+  for (; i < n; i++) {
+    sf += a[i] * c[i];
+    sh += b[i] * c[i];
+  }
+  *f = sf;
+  *h = sh;
+}
+
+// Computes a * b
+static inline real KERNEL(Dot)(const real *a, const real *b, long long n) {
+  long long i = 0;
+  vreal v = VZERO();
+  real sum;
+  for (; i + VLEN <= n; i += VLEN) v = VFMADD(VLOAD(a + i), VLOAD(b + i), v);
+  sum = VSUM(v);
+  for (; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+// Multiplies x by s
+static inline void KERNEL(ScaleRow)(real *x, real s, long long n) {
+  long long i = 0;
+  vreal vs = VSET1(s);
+  for (; i + VLEN <= n; i += VLEN) VSTORE(x + i, VMUL(VLOAD(x + i), vs));
+  for (; i < n; i++) x[i] *= s;
+}
+
+// Optionally multiplies x by sx, sets y = cy * y + ky * d and returns the squared norm of the new y
+static inline real KERNEL(ScaleStepRow)(real *x, real sx, real *y, real cy, real ky, const real *d, long long n) {
+  long long i = 0;
+  vreal vsx = VSET1(sx), vcy = VSET1(cy), vky = VSET1(ky), vy, vn = VZERO();
+  real norm, t;
+  for (; i + VLEN <= n; i += VLEN) {
+    if (x != NULL) VSTORE(x + i, VMUL(VLOAD(x + i), vsx));
+    vy = VFMADD(VLOAD(y + i), vcy, VMUL(VLOAD(d + i), vky));
+    VSTORE(y + i, vy);
+    vn = VFMADD(vy, vy, vn);
+  }
+  norm = VSUM(vn);
+  for (; i < n; i++) {
+    if (x != NULL) x[i] *= sx;
+    t = cy * y[i] + ky * d[i];
+    y[i] = t;
+    norm += t * t;
+  }
+  return norm;
+}
+
+// Riemannian update of a margin-violating triple, given f = pos * anc and h = neg * anc: pulls the positive word
+// towards the anchor, pushes the negative word away from it, moves the anchor by the combined gradient (kept in
+// neu1e) and projects all three rows back onto the unit sphere. Each loop fuses a step with the normalisation of
+// the row stepped before it: (1) anchor gradient and positive step, reading pos, neg and anc; (2) normalise pos and
+// step neg; (3) normalise neg and step anc; (4) normalise anc. That is four loops over n, which read and write
+// several rows each, instead of one loop per step and per normalisation; when neg aliases pos, loop (2) is split
+// in two, for five.
+static void KERNEL(MarginUpdate)(real *pos, real *neg, real *anc, real *neu1e, real f, real h, real lr, long long n) {
+  long long i = 0;
+  vreal vp, vq, va, vn = VZERO();
+  real sp = lr * (1 - f), sn = lr * 2 * h, norm, p;
+  vreal vhf = VSET1(h - f), vpc = VSET1(1 - sp * f), vpa = VSET1(sp);
+  // anchor gradient and positive step (negative Riemannian gradient scaled by the cosine distance 1 - f)
+  for (; i + VLEN <= n; i += VLEN) {
+    vp = VLOAD(pos + i);
+    va = VLOAD(anc + i);
+    vq = VLOAD(neg + i);
+    VSTORE(neu1e + i, VFMADD(vhf, va, VSUB(vp, vq)));
+    vp = VFMADD(vpc, vp, VMUL(vpa, va));
+    VSTORE(pos + i, vp);
+    vn = VFMADD(vp, vp, vn);
+  }
+  norm = VSUM(vn);
+  for (; i < n; i++) {
+    neu1e[i] = pos[i] + (h - f) * anc[i] - neg[i];
+    p = (1 - sp * f) * pos[i] + sp * anc[i];
+    pos[i] = p;
+    norm += p * p;
+  }
+  // normalize the positive row while stepping the negative one (step 2 * h); they only alias for a negative sample
+  // equal to the positive word, in which case the negative step must see the normalized row
+  if (pos != neg) norm = KERNEL(ScaleStepRow)(pos, 1 / sqrt(norm), neg, 1 + sn * h, -sn, anc, n);
+  else {
+    KERNEL(ScaleRow)(pos, 1 / sqrt(norm), n);
+    norm = KERNEL(ScaleStepRow)(NULL, 0, neg, 1 + sn * h, -sn, anc, n);
+  }
+  // normalize the negative row while stepping the anchor (step 1 - (f - h))
+  norm = KERNEL(ScaleStepRow)(neg, 1 / sqrt(norm), anc, 1, lr * (1 - (f - h)), neu1e, n);
+  KERNEL(ScaleRow)(anc, 1 / sqrt(norm), n);
+}
+
+// Update of the anchor row alone, for frozen word vectors: the anchor step of MarginUpdate followed by the
+// renormalisation, in two passes
+static void KERNEL(AnchorUpdate)(const real *pos, const real *neg, real *anc, real f, real h, real lr, long long n) {
+  long long i = 0;
+  real s = lr * (1 - (f - h)), norm, t;
+  vreal vc = VSET1(1 + s * (h - f)), vs = VSET1(s), va, vn = VZERO();
+  for (; i + VLEN <= n; i += VLEN) {
+    va = VFMADD(VLOAD(anc + i), vc, VMUL(VSUB(VLOAD(pos + i), VLOAD(neg + i)), vs));
+    VSTORE(anc + i, va);
+    vn = VFMADD(va, va, vn);
+  }
+  norm = VSUM(vn);
+  for (; i < n; i++) {
+    t = (1 + s * (h - f)) * anc[i] + s * (pos[i] - neg[i]);
+    anc[i] = t;
+    norm += t * t;
+  }
+  KERNEL(ScaleRow)(anc, 1 / sqrt(norm), n);
+}
+
+// Computes out[i] = blk[i] * x for the num_rows consecutive rows of blk, two rows per pass over x
+static inline void KERNEL(MatVec)(const real *blk, int num_rows, const real *x, real *out, long long n) {
+  int i;
+  for (i = 0; i + 1 < num_rows; i += 2) KERNEL(Dot2)(blk + i * n, blk + (i + 1) * n, x, n, &out[i], &out[i + 1]);
+  if (i < num_rows) KERNEL(Dot2)(blk + i * n, blk + i * n, x, n, &out[i], &out[i]);
+}
+
+// Sets y += a * x
+static inline void KERNEL(AxpyRow)(real *y, real a, const real *x, long long n) {
+  long long i = 0;
+  vreal va = VSET1(a);
+  for (; i + VLEN <= n; i += VLEN) VSTORE(y + i, VFMADD(VLOAD(x + i), va, VLOAD(y + i)));
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+// Minibatched counterpart of MarginUpdate around a single anchor row. rows[] points to the rows taking part:
+// positives (owner -1) and the negatives sampled for them (owner = index of their positive in rows[]). The rows are
+// gathered into the dense block blk, their similarities to the anchor come from one matrix-vector product, and
+// every row is moved once by its accumulated Riemannian gradient (a combination of itself and the anchor) and
+// renormalized. Returns the summed margin objective. coef needs 3 * num_rows entries.
+static real KERNEL(BatchMarginUpdate)(real **rows, int *owner, int num_rows, real *anc, real *blk, real *sims,
+                                      real *coef, real *neu1e, real lr, long long n, struct margin_counts *mc) {
+  int i, j;
+  real f, h, s, obj = 0, c_anc = 0, norm;
+  real *c_self = coef, *c_anc_row = coef + num_rows, *c_neu = coef + 2 * num_rows;
+  for (i = 0; i < num_rows; i++) {
+    memcpy(blk + i * n, rows[i], n * sizeof(real));
+    c_self[i] = c_anc_row[i] = c_neu[i] = 0;
+  }
+  KERNEL(MatVec)(blk, num_rows, anc, sims, n);
+  for (i = 0; i < num_rows; i++) {
+    j = owner[i];
+    if (j < 0) continue;
+    f = sims[j];
+    h = sims[i];
+    mc->pairs++;
+    if (f - h >= margin) continue;
+    mc->violations++;
+    obj += margin - (f - h);
+    s = 1 - (f - h);
+    // anchor gradient (pos - neg) + (h - f) * anc, scaled by 1 - (f - h)
+    c_neu[j] += s;
+    c_neu[i] -= s;
+    c_anc += s * (h - f);
+    // positive: (1 - f) * (anc - f * pos); negative: 2 * h * (h * neg - anc)
+    c_anc_row[j] += 1 - f;
+    c_self[j] -= (1 - f) * f;
+    c_anc_row[i] -= 2 * h;
+    c_self[i] += 2 * h * h;
+  }
+  if (obj == 0) return 0;
+  for (i = 0; i < n; i++) neu1e[i] = c_anc * anc[i];
+  for (i = 0; i < num_rows; i++) {
+    if (c_neu[i] != 0) KERNEL(AxpyRow)(neu1e, c_neu[i], blk + i * n, n);
+    if (c_anc_row[i] == 0 && c_self[i] == 0) continue;
+    norm = KERNEL(ScaleStepRow)(NULL, 0, rows[i], 1 + lr * c_self[i], lr * c_anc_row[i], anc, n);
+    KERNEL(ScaleRow)(rows[i], 1 / sqrt(norm), n);
+  }
+  norm = KERNEL(ScaleStepRow)(NULL, 0, anc, 1, lr, neu1e, n);
+  KERNEL(ScaleRow)(anc, 1 / sqrt(norm), n);
+  return obj;
+}
+
+static const struct row_kernels KERNEL(kernels) = {
+  KERNEL_STRING(KERNEL_ISA), KERNEL_LEVEL, KERNEL(Dot2), KERNEL(Dot), KERNEL(ScaleRow), KERNEL(MarginUpdate),
+  KERNEL(AnchorUpdate), KERNEL(MatVec), KERNEL(BatchMarginUpdate)
+};
+
+#undef VLEN
+#undef vreal
+#undef VZERO
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+#undef VSUB
+#undef VMUL
+#undef VFMADD
+#undef VSUM
+#undef KERNEL_VEC
+#undef KERNEL_LEVEL
+#undef KERNEL_ISA